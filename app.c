@@ -25,6 +25,7 @@
 #include <ControlDefinitions.h>
 #include <Resources.h>
 
+#include <stddef.h>
 #include <stdio.h>
 
 // forward declarations
@@ -84,6 +85,16 @@ struct window_context* window_for_session(int session_idx)
 	return &windows[wid];
 }
 
+struct filter_state* filter_state(int session_idx)
+{
+	return &sessions[session_idx].filter;
+}
+
+struct iac_state* iac_state(int session_idx)
+{
+	return &sessions[session_idx].iac;
+}
+
 int active_session_global(void)
 {
 	return ACTIVE_WIN.session_ids[ACTIVE_WIN.active_session_idx];
@@ -165,7 +176,7 @@ void set_terminal_string(void)
 /* ---- Resource-based preferences ---- */
 
 /* disk layout for 'PREF' resource — bump DISK_PREFS_VERSION if you change this struct */
-#define DISK_PREFS_VERSION 2
+#define DISK_PREFS_VERSION 9
 
 struct disk_prefs
 {
@@ -191,8 +202,27 @@ struct disk_prefs
 	char pubkey_path[1024];
 	/* v2 fields — append only, never insert above */
 	short bold_is_bright;
+	/* v3 fields */
+	short ssh_profile;
+	/* v4 fields */
+	short key_cache_minutes;
+	/* v5 fields */
+	short send_coalesce;
+	/* v6 fields */
+	short paste_bracket;
+	short paste_pace;
+	/* v7 fields */
+	short local_echo;
+	/* v8 fields */
+	short ssh_keepalive;
+	short ssh_compress;
+	/* v9 fields */
+	short sftp_requests;
 };
 
+/* oldest layout we still accept (v1 ends before bold_is_bright) */
+#define DISK_PREFS_V1_SIZE offsetof(struct disk_prefs, bold_is_bright)
+
 static OSErr get_prefs_spec(FSSpec* spec)
 {
 	short vRefNum;
@@ -292,6 +322,29 @@ have_file:
 	/* v2 fields */
 	dp->bold_is_bright = (short)prefs.bold_is_bright;
 
+	/* v3 fields */
+	dp->ssh_profile = (short)prefs.ssh_profile;
+
+	/* v4 fields */
+	dp->key_cache_minutes = (short)prefs.key_cache_minutes;
+
+	/* v5 fields */
+	dp->send_coalesce = (short)prefs.send_coalesce;
+
+	/* v6 fields */
+	dp->paste_bracket = (short)prefs.paste_bracket;
+	dp->paste_pace = (short)prefs.paste_pace;
+
+	/* v7 fields */
+	dp->local_echo = (short)prefs.local_echo;
+
+	/* v8 fields */
+	dp->ssh_keepalive = (short)prefs.ssh_keepalive;
+	dp->ssh_compress = (short)prefs.ssh_compress;
+
+	/* v9 fields */
+	dp->sftp_requests = (short)prefs.sftp_requests;
+
 	HUnlock(h);
 
 	AddResource(h, 'PREF', 128, "\pPreferences");
@@ -396,6 +449,15 @@ void init_prefs(void)
 	prefs.font_size = 9;
 	prefs.prompt_color = 4; /* blue */
 	prefs.bold_is_bright = 1;
+	prefs.ssh_profile = SSH_PROFILE_COMPATIBLE;
+	prefs.key_cache_minutes = -1;
+	prefs.send_coalesce = 1;
+	prefs.paste_bracket = 1;
+	prefs.paste_pace = 0;
+	prefs.local_echo = 0;
+	prefs.ssh_keepalive = 0;
+	prefs.ssh_compress = 0;
+	prefs.sftp_requests = 4;
 
 	init_dark_palette();
 
@@ -538,8 +600,8 @@ void load_prefs(void)
 		return;
 	}
 
-	/* v1 struct is smaller (no bold_is_bright); accept either size */
-	if (GetHandleSize(h) < (long)(sizeof(struct disk_prefs) - sizeof(short)))
+	/* older structs are smaller; accept anything from v1 up */
+	if (GetHandleSize(h) < (long)DISK_PREFS_V1_SIZE)
 	{
 		ReleaseResource(h);
 		CloseResFile(refNum);
@@ -600,6 +662,40 @@ void load_prefs(void)
 	if (dp->version >= 2)
 		prefs.bold_is_bright = dp->bold_is_bright;
 
+	/* v3 fields */
+	if (dp->version >= 3)
+		prefs.ssh_profile = dp->ssh_profile;
+
+	/* v4 fields */
+	if (dp->version >= 4)
+		prefs.key_cache_minutes = dp->key_cache_minutes;
+
+	/* v5 fields */
+	if (dp->version >= 5)
+		prefs.send_coalesce = dp->send_coalesce;
+
+	/* v6 fields */
+	if (dp->version >= 6)
+	{
+		prefs.paste_bracket = dp->paste_bracket ? 1 : 0;
+		prefs.paste_pace = dp->paste_pace;
+	}
+
+	/* v7 fields */
+	if (dp->version >= 7)
+		prefs.local_echo = dp->local_echo ? 1 : 0;
+
+	/* v8 fields */
+	if (dp->version >= 8)
+	{
+		prefs.ssh_keepalive = dp->ssh_keepalive;
+		prefs.ssh_compress = dp->ssh_compress ? 1 : 0;
+	}
+
+	/* v9 fields */
+	if (dp->version >= 9)
+		prefs.sftp_requests = dp->sftp_requests;
+
 	HUnlock(h);
 	ReleaseResource(h);
 	CloseResFile(refNum);
@@ -609,6 +705,18 @@ void load_prefs(void)
 		prefs.auth_type = USE_PASSWORD;
 	if (prefs.display_mode != FASTEST && prefs.display_mode != COLOR)
 		prefs.display_mode = detect_color_screen() ? COLOR : FASTEST;
+	if (prefs.ssh_profile < 0 || prefs.ssh_profile >= SSH_PROFILE_COUNT)
+		prefs.ssh_profile = SSH_PROFILE_COMPATIBLE;
+	if (prefs.key_cache_minutes < -1)
+		prefs.key_cache_minutes = -1;
+	if (prefs.send_coalesce < 0 || prefs.send_coalesce > 30)
+		prefs.send_coalesce = 1;
+	if (prefs.paste_pace < 0 || prefs.paste_pace > 60)
+		prefs.paste_pace = 0;
+	if (prefs.ssh_keepalive < 0 || prefs.ssh_keepalive > 3600)
+		prefs.ssh_keepalive = 0;
+	if (prefs.sftp_requests < 1 || prefs.sftp_requests > 8)
+		prefs.sftp_requests = 4;
 	if (qd_color_to_menu_item(prefs.fg_color) == 1 && prefs.fg_color != COLOR_FROM_THEME)
 		prefs.fg_color = COLOR_FROM_THEME;
 	if (qd_color_to_menu_item(prefs.bg_color) == 1 && prefs.bg_color != COLOR_FROM_THEME)
@@ -652,7 +760,7 @@ void display_about_box(void)
 static void session_write(int idx, char* buf, size_t len)
 {
 	if (sessions[idx].type == SESSION_SSH)
-		ssh_write_s(idx, buf, len);
+		session_send(idx, buf, len);
 	else if (sessions[idx].type == SESSION_TELNET)
 	{
 		/* telnet protocol: CR must be followed by LF */
@@ -666,12 +774,12 @@ static void session_write(int idx, char* buf, size_t len)
 				tbuf[ti++] = '\n';
 			if (ti >= sizeof(tbuf) - 2)
 			{
-				tcp_write_s(idx, tbuf, ti);
+				session_send(idx, tbuf, ti);
 				ti = 0;
 			}
 		}
 		if (ti > 0)
-			tcp_write_s(idx, tbuf, ti);
+			session_send(idx, tbuf, ti);
 	}
 }
 
@@ -683,14 +791,15 @@ void ssh_paste(void)
 	// GetScrap requires a handle, not a raw buffer
 	// it will increase the size of the handle if needed
 	Handle buf = NewHandle(256);
-	int r = GetScrap(buf, 'TEXT', 0);
+	long offset = 0;
+	long r = GetScrap(buf, 'TEXT', &offset);
 
-	if (r > 0)
+	// the session thread streams it out and disposes of the handle
+	if (r <= 0 || !session_paste_start(sid, buf, r))
 	{
-		session_write(sid, *buf, r);
+		if (r > 0) SysBeep(1);
+		DisposeHandle(buf);
 	}
-
-	DisposeHandle(buf);
 }
 
 void ssh_copy(void)
@@ -980,17 +1089,45 @@ void init_session(struct session* s)
 	s->mouse_mode = CLICK_SELECT;
 	s->channel = NULL;
 	s->ssh_session = NULL;
+	s->ssh_conn = -1;
+	memset(&s->ssh_algos, 0, sizeof(s->ssh_algos));
+	s->ssh_keepalive = -1;
+	s->ssh_compress = -1;
+	s->wake_at = 0;
+	s->conn_timing = 0;
 	s->endpoint = kOTInvalidEndpointRef;
 	s->recv_buffer = NULL;
 	s->send_buffer = NULL;
 	s->telnet_host[0] = '\0';
 	s->telnet_port = 0;
-	s->telnet_state = 0;
-	s->telnet_sb_len = 0;
+	s->iac.state = 0;
+	s->iac.sb_len = 0;
+	s->mccp = NULL;
+	s->filter.ansi_fixup = 0;
+	s->filter.crlf_prev_cr = 0;
 	s->thread_command = WAIT;
 	s->thread_state = UNINITIALIZED;
 	s->thread_id = kNoThreadID;
 	s->worker_mode = WORKER_NONE;
+	s->net_ready = 0;
+	s->net_sleeping = 0;
+	s->out_len = 0;
+	s->out_blocked = 0;
+	s->out_since = 0;
+	s->paste_data = NULL;
+	s->paste_pos = 0;
+	s->paste_len = 0;
+	s->paste_resume = 0;
+	s->paste_shown = 0;
+	s->paste_bracketed = 0;
+	s->paste_titled = 0;
+	s->predict_len = 0;
+	s->predict_row = 0;
+	s->predict_col = 0;
+	s->predict_since = 0;
+	s->predict_trust = 0;
+	s->predict_hold = 0;
+	s->alt_screen = 0;
 	s->shell_vRefNum = 0;
 	s->shell_dirID = 0;
 	s->shell_line[0] = '\0';
@@ -998,7 +1135,14 @@ void init_session(struct session* s)
 	s->shell_cursor_pos = 0;
 	s->shell_history = NULL;
 	s->wget_url[0] = '\0';
+	s->wget_list = NULL;
+	s->wget_body = NULL;
 	s->wget_no_progress = 0;
+	s->wget_resume = 0;
+	s->wget_keep_gz = 0;
+	s->bench_what = 0;
+	s->bench_profile = -1;
+	s->bench_host[0] = '\0';
 	s->scp_user[0] = '\0';
 	s->scp_host[0] = '\0';
 	s->scp_port[0] = '\0';
@@ -1006,6 +1150,8 @@ void init_session(struct session* s)
 	s->scp_local_path[0] = '\0';
 	s->scp_direction = 0;
 	s->scp_no_progress = 0;
+	s->scp_resume = 0;
+	s->scp_recursive = 0;
 	s->scp_local_file_size = 0;
 	s->scp_password[0] = '\0';
 	s->scp_pubkey_path[0] = '\0';
@@ -1282,6 +1428,7 @@ void close_session(int idx)
 			else if (s->thread_id != kNoThreadID)
 			{
 				s->thread_command = EXIT;
+				tcp_wake(idx);
 				if (s->endpoint != kOTInvalidEndpointRef)
 					OTCancelSynchronousCalls(s->endpoint, kOTCanceledErr);
 
@@ -1531,6 +1678,7 @@ void close_window(int wid)
 				else if (s->thread_id != kNoThreadID)
 				{
 					s->thread_command = EXIT;
+					tcp_wake(sid);
 					if (s->endpoint != kOTInvalidEndpointRef)
 						OTCancelSynchronousCalls(s->endpoint, kOTCanceledErr);
 
@@ -1769,6 +1917,9 @@ int handle_keypress(EventRecord* event)
 			case 'v':
 				ssh_paste();
 				break;
+			case '.':
+				session_paste_cancel(sid);
+				break;
 			case 'c':
 				ssh_copy();
 				break;
@@ -1886,6 +2037,7 @@ int handle_keypress(EventRecord* event)
 			if (vkeycode == 0x4C)
 			{
 				sessions[sid].send_buffer[0] = '\r';
+				predict_key(sid, 0);
 				session_write(sid, sessions[sid].send_buffer, 1);
 			}
 			/* right-Ctrl+key: QEMU sends charcode as control code but no
@@ -1897,12 +2049,14 @@ int handle_keypress(EventRecord* event)
 			    ascii_to_control_code[unmodified_key] == c)
 			{
 				sessions[sid].send_buffer[0] = c;
+				predict_key(sid, 0);
 				session_write(sid, sessions[sid].send_buffer, 1);
 			}
 			/* if we have a control code for this key */
 			else if (event->modifiers & controlKey && ascii_to_control_code[unmodified_key] != 255)
 			{
 				sessions[sid].send_buffer[0] = ascii_to_control_code[unmodified_key];
+				predict_key(sid, 0);
 				session_write(sid, sessions[sid].send_buffer, 1);
 			}
 			else
@@ -1910,6 +2064,7 @@ int handle_keypress(EventRecord* event)
 				if (event->modifiers & optionKey && c >= 32 && c <= 126)
 				{
 					sessions[sid].send_buffer[0] = c;
+					predict_key(sid, 0);
 					session_write(sid, sessions[sid].send_buffer, 1);
 				}
 				else
@@ -1922,11 +2077,13 @@ int handle_keypress(EventRecord* event)
 
 					if (key_to_vterm[c] != VTERM_KEY_NONE)
 					{
+						predict_key(sid, 0);
 						vterm_keyboard_key(sessions[sid].vterm, key_to_vterm[c], VTERM_MOD_NONE);
 					}
 					else
 					{
 						sessions[sid].send_buffer[0] = event->modifiers & optionKey ? unmodified_key : c;
+						predict_key(sid, (event->modifiers & optionKey) ? 0 : c);
 						session_write(sid, sessions[sid].send_buffer, 1);
 					}
 				}
@@ -2069,10 +2226,14 @@ void event_loop(void)
 	{
 		// wait to get a GUI event
 		while (!WaitNextEvent(everyEvent, &event,
-		                      has_active_local_worker() ? 1 : sleep_time, NULL))
+		                      (has_active_local_worker() || session_output_pending())
+		                      ? 1 : sleep_time, NULL))
 		{
+			tcp_wake_sleepers();
 			YieldToAnyThread();
 			reap_detached_sessions();
+			known_hosts_flush(0);
+			key_cache_expire();
 
 			// iterate all windows for idle tasks
 			int i;
@@ -2087,6 +2248,10 @@ void event_loop(void)
 					int sid = windows[i].session_ids[windows[i].active_session_idx];
 					if (sessions[sid].scrollbar_dirty)
 						sync_scrollbar(&windows[i]);
+
+					/* expire echo predictions the server never answered */
+					if (sessions[sid].predict_len > 0)
+						predict_check(sid, 0);
 				}
 
 				if (windows[i].needs_redraw)
@@ -2834,6 +2999,7 @@ int ssh_connect(int session_idx)
 		EndUpdate(wc->win);
 	}
 
+	ssh_take_options(session_idx);
 	ok = intro_dialog();
 
 	if (!ok) printf_s(session_idx, "Cancelled, not connecting.\r\n");
@@ -2916,6 +3082,7 @@ void ssh_disconnect(int session_idx)
 
 	// tell the read thread to finish, then let it run to actually do so
 	s->thread_command = EXIT;
+	tcp_wake(session_idx);
 
 	if (s->thread_state != DONE)
 	{
@@ -2950,6 +3117,11 @@ void ssh_disconnect(int session_idx)
 			printf_s(session_idx, "Warning: worker thread could not be reclaimed.\r\n");
 	}
 
+	/* a thread that was force-stopped never dropped its share of the
+	   SSH connection; other tabs may still be using it */
+	if (s->thread_id == kNoThreadID && s->thread_state != DONE && s->ssh_conn >= 0)
+		end_connection(session_idx);
+
 	/* only free buffers if thread actually finished — if it timed out
 	   the thread may still be using them; leak rather than use-after-free */
 	if (s->thread_state == DONE && s->thread_id == kNoThreadID)
@@ -3078,6 +3250,9 @@ int main(int argc, char** argv)
 
 	event_loop();
 
+	/* don't lose a host accepted since the last idle write */
+	known_hosts_flush(1);
+
 	/* cleanup all windows and sessions */
 	{
 		int i;
@@ -23,6 +23,8 @@
 #include <vterm_keycodes.h>
 
 #include "constants.r"
+#include "filter.h"
+#include "iac.h"
 
 #define MAX_SESSIONS 8
 #define MAX_WINDOWS 8
@@ -42,7 +44,22 @@ enum MOUSE_MODE { CLICK_SEND, CLICK_SELECT };
 enum SESSION_TYPE { SESSION_NONE, SESSION_SSH, SESSION_LOCAL, SESSION_TELNET };
 enum THREAD_COMMAND { WAIT, READ, EXIT };
 enum THREAD_STATE { UNINITIALIZED, OPEN, CLEANUP, DONE };
-enum WORKER_MODE { WORKER_NONE, WORKER_NC, WORKER_WGET, WORKER_SCP, WORKER_FTP };
+enum WORKER_MODE { WORKER_NONE, WORKER_NC, WORKER_WGET, WORKER_SCP, WORKER_SFTP, WORKER_FTP, WORKER_BENCH };
+enum SSH_PROFILE { SSH_PROFILE_FAST, SSH_PROFILE_COMPATIBLE, SSH_PROFILE_STRICT, SSH_PROFILE_COUNT };
+
+/* algorithms negotiated by an SSH handshake, "" = not connected */
+struct ssh_algos
+{
+	char kex[40];
+	char hostkey[32];
+	char cipher_cs[32];  /* client to server */
+	char cipher_sc[32];  /* server to client */
+	char mac_cs[32];
+	char mac_sc[32];
+	char comp[24];
+	unsigned char profile;   /* enum SSH_PROFILE offered */
+	long handshake_ticks;
+};
 
 // per-session state (terminal + connection + thread)
 struct session
@@ -73,23 +90,59 @@ struct session
 	// SSH connection (SESSION_SSH only)
 	LIBSSH2_CHANNEL* channel;
 	LIBSSH2_SESSION* ssh_session;
+	int ssh_conn;          /* shared SSH connection index, -1 = none */
+	struct ssh_algos ssh_algos;
+	int ssh_keepalive;     /* seconds, -1 = prefs, 0 = off */
+	int ssh_compress;      /* offer zlib: -1 = prefs, 0 = no, 1 = yes */
+	unsigned long wake_at; /* TickCount to wake the sleeping thread, 0 = never */
+	unsigned long conn_timing;  /* open conninfo record, 0 = none */
 	EndpointRef endpoint;
 	char* recv_buffer;
 	char* send_buffer;
 
+	// outbound queue, written by the session thread (SSH/telnet/nc)
+	#define OUT_QUEUE_SIZE 1024
+	char out_queue[OUT_QUEUE_SIZE];
+	unsigned short out_len;
+	unsigned char out_blocked;   /* last write hit EAGAIN/kOTFlowErr */
+	unsigned long out_since;     /* TickCount of the oldest queued byte */
+
+	// streaming paste, fed into the outbound queue by the session thread
+	Handle paste_data;           /* locked scrap copy, NULL = none running */
+	long paste_pos;
+	long paste_len;
+	unsigned long paste_resume;  /* telnet pacing: next line not before */
+	unsigned long paste_shown;   /* last progress title update */
+	unsigned char paste_bracketed;
+	unsigned char paste_titled;  /* progress is in the window title */
+	char paste_title[256];       /* the title it covered */
+
+	// local echo prediction (console.c)
+	#define PREDICT_MAX 32
+	char predict_text[PREDICT_MAX];          /* typed, not yet echoed */
+	unsigned char predict_show[PREDICT_MAX]; /* drawn as tentative cells */
+	int predict_len;
+	int predict_row;                /* screen cell of predict_text[0] */
+	int predict_col;
+	unsigned long predict_since;    /* last progress, for the timeout */
+	unsigned char predict_trust;    /* server echo seen at a prompt */
+	unsigned char predict_hold;     /* non-printable key sent, wait for reply */
+	unsigned char alt_screen;       /* full screen app running */
+
 	// telnet/nc connection (SESSION_TELNET/SESSION_NETCAT only)
 	char telnet_host[256];
 	unsigned short telnet_port;
-	unsigned char telnet_state;       /* IAC parser state */
-	unsigned char telnet_sb_buf[64];  /* subnegotiation buffer */
-	int telnet_sb_len;
-	unsigned char ansi_fixup_state;  /* 0=normal, 1=saw ESC, 2=saw ESC[ */
+	struct iac_state iac;             /* IAC parser state */
+	struct inflater* mccp;            /* MCCP2 decompressor, NULL when off */
+	struct filter_state filter;       /* ANSI.SYS fixup and CRLF state */
 
 	// thread state
 	enum THREAD_COMMAND thread_command;
 	enum THREAD_STATE thread_state;
 	ThreadID thread_id;
 	enum WORKER_MODE worker_mode;
+	volatile unsigned char net_ready;     /* set by OT notifier on data/disconnect */
+	volatile unsigned char net_sleeping;  /* thread is stopped waiting for net_ready */
 
 	// local shell state (SESSION_LOCAL only)
 	short shell_vRefNum;
@@ -106,7 +159,16 @@ struct session
 	char shell_saved_line[256]; // saved line when browsing history
 	int shell_saved_len;
 	char wget_url[512]; // last/active wget URL for local wget worker
+	char* wget_list; // wget batch: NewPtr'd URLs, newline separated
+	struct http_body* wget_body; // wget response body being filtered to disk
 	unsigned char wget_no_progress; // wget -n disables live progress redraw
+	unsigned char wget_resume; // wget -c continues partial files with Range
+	unsigned char wget_keep_gz; // wget -g saves gzip bodies as .gz, uninflated
+
+	// sshbench worker: crypto primitives or handshakes against bench_host
+	int bench_what;         // BENCH_* mask
+	int bench_profile;      // handshake profile, -1 = all
+	char bench_host[264];   // "host:port", "" = crypto only
 
 	// SCP state: set by cmd_scp() before worker spawn, read-only by worker
 	char scp_user[256];
@@ -115,8 +177,10 @@ struct session
 	char scp_remote_path[512];
 	char scp_local_path[64];        // local filename for download (31 char HFS limit)
 	FSSpec scp_local_spec;          // resolved FSSpec for upload source
-	unsigned char scp_direction;    // 0=download, 1=upload
+	unsigned char scp_direction;    // 0=download, 1=upload, 2=list (sftp)
 	unsigned char scp_no_progress;
+	unsigned char scp_resume;       // sftp -c: continue a partial file
+	unsigned char scp_recursive;    // scp -r: whole folder trees
 	long scp_local_file_size;       // upload: pre-resolved file size
 
 	// auth snapshot: captured from prefs in cmd_scp() main thread
@@ -245,6 +309,15 @@ struct preferences
 	int prompt_color; /* ANSI color index 0-15, default 4 (blue) */
 	int bold_is_bright; /* 1 = bold promotes color 0-7 to 8-15 (default) */
 	char theme_name[64];
+	int ssh_profile; /* enum SSH_PROFILE, algorithm order for new connections */
+	int key_cache_minutes; /* decrypted key lifetime: 0 = off, -1 = no limit */
+	int send_coalesce; /* ticks typed bytes may wait to share one packet */
+	int paste_bracket; /* wrap pastes in bracketed-paste markers when asked */
+	int paste_pace; /* telnet paste: ticks to wait after each line */
+	int local_echo; /* predict echo of typing at shell prompts */
+	int ssh_keepalive; /* seconds between SSH keepalives, 0 = off */
+	int ssh_compress; /* offer zlib compression to SSH servers */
+	int sftp_requests; /* SFTP reads/writes kept in flight */
 };
 
 extern struct preferences prefs;
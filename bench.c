@@ -0,0 +1,401 @@
+/*
+ * SevenTTY - crypto and handshake benchmarks
+ *
+ * Times the mbedtls primitives behind each SSH algorithm, as built for
+ * this app, so the algorithm profiles can be picked from numbers taken
+ * on the actual 68030/68040/601 machines instead of guesses. Only
+ * bench.h's hooks, printf_s and the two Toolbox calls below tie it to
+ * the app, so tools/bench_host.c can run the same code on a host.
+ */
+
+#include "bench.h"
+#include "console.h"
+
+#include <Threads.h>
+#include <Timer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mbedtls/aes.h>
+#include <mbedtls/chacha20.h>
+#include <mbedtls/md.h>
+#include <mbedtls/bignum.h>
+#include <mbedtls/dhm.h>
+#include <mbedtls/ecdh.h>
+
+#define BENCH_BUF_SIZE   4096
+#define BENCH_SYM_USEC   2000000UL  /* run each bulk primitive ~2 s */
+#define BENCH_KEX_USEC   3000000UL  /* and each key exchange op ~3 s */
+#define BENCH_BURST_USEC 100000UL   /* yield to the UI this often */
+
+/* ---- timing ---- */
+
+static unsigned long bench_usec(void)
+{
+	UnsignedWide t;
+	Microseconds(&t);
+	return t.lo;
+}
+
+/* Work is timed in bursts with a yield between them, and only the time
+   inside bursts counts, so the event loop does not skew the numbers. */
+struct bench_timer
+{
+	unsigned long busy;    /* usec spent working */
+	unsigned long start;   /* start of the current burst */
+	unsigned long ops;
+};
+
+static void bench_begin(struct bench_timer* t)
+{
+	t->busy = 0;
+	t->ops = 0;
+	t->start = bench_usec();
+}
+
+/* count one op; returns 0 once the time budget is used up or the user
+   hit Ctrl+C */
+static int bench_tick(int idx, struct bench_timer* t, unsigned long budget)
+{
+	unsigned long now = bench_usec();
+
+	t->ops++;
+
+	if (now - t->start < BENCH_BURST_USEC)
+		return 1;
+
+	t->busy += now - t->start;
+	if (t->busy >= budget || bench_cancelled(idx))
+		return 0;
+
+	YieldToAnyThread();
+	t->start = bench_usec();
+	return 1;
+}
+
+static void bench_report_rate(int idx, const char* name, struct bench_timer* t,
+                              unsigned long bytes_per_op)
+{
+	unsigned long kb = t->ops * (bytes_per_op / 64) / 16;  /* ops * bytes / 1024 */
+	unsigned long ms = t->busy / 1000;
+	unsigned long kbps;
+
+	if (ms == 0) ms = 1;
+	/* KB/s with one decimal, kept inside 32 bits */
+	if (kb < 400000UL)
+		kbps = kb * 10000UL / ms;
+	else
+		kbps = kb / ms * 10000UL;
+
+	/* a fast host gets MB/s */
+	if (kbps >= 100000UL)
+	{
+		kbps /= 1024;
+		printf_s(idx, "  %-24s %6lu.%lu MB/s\r\n", name, kbps / 10, kbps % 10);
+	}
+	else
+		printf_s(idx, "  %-24s %6lu.%lu KB/s\r\n", name, kbps / 10, kbps % 10);
+}
+
+static void bench_report_ops(int idx, const char* name, struct bench_timer* t)
+{
+	unsigned long us_per_op = t->busy / (t->ops ? t->ops : 1);
+	unsigned long centi_ops = t->ops * 100000UL / (t->busy / 1000 ? t->busy / 1000 : 1);
+
+	if (us_per_op >= 10000UL)
+		printf_s(idx, "  %-24s %6lu ms/op  (%lu.%02lu ops/s)\r\n", name,
+			us_per_op / 1000, centi_ops / 100, centi_ops % 100);
+	else
+		printf_s(idx, "  %-24s %6lu us/op  (%lu.%02lu ops/s)\r\n", name,
+			us_per_op, centi_ops / 100, centi_ops % 100);
+}
+
+/* predictable filler; nothing here needs real randomness */
+static int bench_rng(void* ctx, unsigned char* out, size_t len)
+{
+	unsigned long* state = ctx;
+
+	while (len-- > 0)
+	{
+		*state ^= *state << 13;
+		*state ^= *state >> 17;
+		*state ^= *state << 5;
+		*out++ = (unsigned char)*state;
+	}
+	return 0;
+}
+
+/* ---- bulk ciphers and MACs ---- */
+
+static int bench_aes_ctr(int idx, unsigned char* buf, int keybits, const char* name)
+{
+	mbedtls_aes_context aes;
+	unsigned char key[32], nonce[16], block[16];
+	size_t off = 0;
+	struct bench_timer t;
+
+	memset(key, 0x5a, sizeof(key));
+	memset(nonce, 0, sizeof(nonce));
+	mbedtls_aes_init(&aes);
+	mbedtls_aes_setkey_enc(&aes, key, keybits);
+
+	bench_begin(&t);
+	do
+		mbedtls_aes_crypt_ctr(&aes, BENCH_BUF_SIZE, &off, nonce, block, buf, buf);
+	while (bench_tick(idx, &t, BENCH_SYM_USEC));
+
+	mbedtls_aes_free(&aes);
+	bench_report_rate(idx, name, &t, BENCH_BUF_SIZE);
+	return !bench_cancelled(idx);
+}
+
+static int bench_aes_cbc(int idx, unsigned char* buf)
+{
+	mbedtls_aes_context aes;
+	unsigned char key[16], iv[16];
+	struct bench_timer t;
+
+	memset(key, 0x5a, sizeof(key));
+	memset(iv, 0, sizeof(iv));
+	mbedtls_aes_init(&aes);
+	mbedtls_aes_setkey_enc(&aes, key, 128);
+
+	bench_begin(&t);
+	do
+		mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, BENCH_BUF_SIZE, iv, buf, buf);
+	while (bench_tick(idx, &t, BENCH_SYM_USEC));
+
+	mbedtls_aes_free(&aes);
+	bench_report_rate(idx, "aes128-cbc", &t, BENCH_BUF_SIZE);
+	return !bench_cancelled(idx);
+}
+
+#if defined(MBEDTLS_CHACHA20_C)
+static int bench_chacha20(int idx, unsigned char* buf)
+{
+	mbedtls_chacha20_context chacha;
+	unsigned char key[32], nonce[12];
+	struct bench_timer t;
+
+	memset(key, 0x5a, sizeof(key));
+	memset(nonce, 0, sizeof(nonce));
+	mbedtls_chacha20_init(&chacha);
+	mbedtls_chacha20_setkey(&chacha, key);
+	mbedtls_chacha20_starts(&chacha, nonce, 0);
+
+	bench_begin(&t);
+	do
+		mbedtls_chacha20_update(&chacha, BENCH_BUF_SIZE, buf, buf);
+	while (bench_tick(idx, &t, BENCH_SYM_USEC));
+
+	mbedtls_chacha20_free(&chacha);
+	bench_report_rate(idx, "chacha20 (no poly1305)", &t, BENCH_BUF_SIZE);
+	return !bench_cancelled(idx);
+}
+#endif
+
+static int bench_hmac(int idx, unsigned char* buf, mbedtls_md_type_t type, const char* name)
+{
+	mbedtls_md_context_t md;
+	unsigned char key[64], out[64];
+	struct bench_timer t;
+
+	memset(key, 0xa5, sizeof(key));
+	mbedtls_md_init(&md);
+	if (mbedtls_md_setup(&md, mbedtls_md_info_from_type(type), 1) != 0)
+	{
+		printf_s(idx, "  %-24s not built in\r\n", name);
+		mbedtls_md_free(&md);
+		return 1;
+	}
+	mbedtls_md_hmac_starts(&md, key, sizeof(key));
+
+	/* one MAC per 4K "packet", like a bulk transfer */
+	bench_begin(&t);
+	do
+	{
+		mbedtls_md_hmac_reset(&md);
+		mbedtls_md_hmac_update(&md, buf, BENCH_BUF_SIZE);
+		mbedtls_md_hmac_finish(&md, out);
+	}
+	while (bench_tick(idx, &t, BENCH_SYM_USEC));
+
+	mbedtls_md_free(&md);
+	bench_report_rate(idx, name, &t, BENCH_BUF_SIZE);
+	return !bench_cancelled(idx);
+}
+
+/* ---- key exchange ---- */
+
+/* one side of a DH exchange is two modexps with a full-size exponent
+   (libssh2 draws x as wide as the group), this times one of them */
+static int bench_dh(int idx, const unsigned char* prime, size_t prime_len, const char* name)
+{
+	mbedtls_mpi p, g, x, e, rr;
+	unsigned long seed = 0x12345678UL;
+	struct bench_timer t;
+	int ok;
+
+	mbedtls_mpi_init(&p);
+	mbedtls_mpi_init(&g);
+	mbedtls_mpi_init(&x);
+	mbedtls_mpi_init(&e);
+	mbedtls_mpi_init(&rr);
+
+	ok = mbedtls_mpi_read_binary(&p, prime, prime_len) == 0 &&
+	     mbedtls_mpi_lset(&g, 2) == 0 &&
+	     mbedtls_mpi_fill_random(&x, prime_len - 1, bench_rng, &seed) == 0;
+
+	if (ok)
+	{
+		bench_begin(&t);
+		do
+			ok = mbedtls_mpi_exp_mod(&e, &g, &x, &p, &rr) == 0;
+		while (ok && bench_tick(idx, &t, BENCH_KEX_USEC));
+	}
+
+	if (ok)
+		bench_report_ops(idx, name, &t);
+	else
+		printf_s(idx, "  %-24s failed\r\n", name);
+
+	mbedtls_mpi_free(&p);
+	mbedtls_mpi_free(&g);
+	mbedtls_mpi_free(&x);
+	mbedtls_mpi_free(&e);
+	mbedtls_mpi_free(&rr);
+	return !bench_cancelled(idx);
+}
+
+/* an ECDH exchange is a key generation plus a shared secret; time the
+   pair as one op */
+static int bench_ecdh(int idx, mbedtls_ecp_group_id id, const char* name)
+{
+	mbedtls_ecp_group grp;
+	mbedtls_ecp_point q, peer;
+	mbedtls_mpi d, peer_d, z;
+	unsigned long seed = 0x87654321UL;
+	struct bench_timer t;
+	int ok;
+
+	mbedtls_ecp_group_init(&grp);
+	mbedtls_ecp_point_init(&q);
+	mbedtls_ecp_point_init(&peer);
+	mbedtls_mpi_init(&d);
+	mbedtls_mpi_init(&peer_d);
+	mbedtls_mpi_init(&z);
+
+	ok = mbedtls_ecp_group_load(&grp, id) == 0 &&
+	     mbedtls_ecp_gen_keypair(&grp, &peer_d, &peer, bench_rng, &seed) == 0;
+
+	if (ok)
+	{
+		bench_begin(&t);
+		do
+			ok = mbedtls_ecp_gen_keypair(&grp, &d, &q, bench_rng, &seed) == 0 &&
+			     mbedtls_ecdh_compute_shared(&grp, &z, &peer, &d, bench_rng, &seed) == 0;
+		while (ok && bench_tick(idx, &t, BENCH_KEX_USEC));
+	}
+
+	if (ok)
+		bench_report_ops(idx, name, &t);
+	else
+		printf_s(idx, "  %-24s not built in\r\n", name);
+
+	mbedtls_ecp_group_free(&grp);
+	mbedtls_ecp_point_free(&q);
+	mbedtls_ecp_point_free(&peer);
+	mbedtls_mpi_free(&d);
+	mbedtls_mpi_free(&peer_d);
+	mbedtls_mpi_free(&z);
+	return !bench_cancelled(idx);
+}
+
+static const unsigned char dh_group14_p[] = MBEDTLS_DHM_RFC3526_MODP_2048_P_BIN;
+static const unsigned char dh_group16_p[] = MBEDTLS_DHM_RFC3526_MODP_4096_P_BIN;
+
+void bench_crypto(int idx, int what)
+{
+	unsigned char* buf = malloc(BENCH_BUF_SIZE);
+
+	if (buf == NULL)
+	{
+		printf_s(idx, "sshbench: out of memory\r\n");
+		return;
+	}
+	memset(buf, 0x3c, BENCH_BUF_SIZE);
+
+	if (what & BENCH_SYM)
+	{
+		printf_s(idx, "Ciphers and MACs (%d byte blocks):\r\n", BENCH_BUF_SIZE);
+		if (!bench_aes_ctr(idx, buf, 128, "aes128-ctr")) goto done;
+		if (!bench_aes_ctr(idx, buf, 256, "aes256-ctr")) goto done;
+		if (!bench_aes_cbc(idx, buf)) goto done;
+#if defined(MBEDTLS_CHACHA20_C)
+		if (!bench_chacha20(idx, buf)) goto done;
+#endif
+		if (!bench_hmac(idx, buf, MBEDTLS_MD_SHA1, "hmac-sha1")) goto done;
+		if (!bench_hmac(idx, buf, MBEDTLS_MD_SHA256, "hmac-sha2-256")) goto done;
+		if (!bench_hmac(idx, buf, MBEDTLS_MD_SHA512, "hmac-sha2-512")) goto done;
+	}
+
+	if (what & BENCH_KEX)
+	{
+		printf_s(idx, "Key exchange:\r\n");
+		if (!bench_ecdh(idx, MBEDTLS_ECP_DP_SECP256R1, "ecdh-sha2-nistp256")) goto done;
+		if (!bench_ecdh(idx, MBEDTLS_ECP_DP_SECP384R1, "ecdh-sha2-nistp384")) goto done;
+		if (!bench_ecdh(idx, MBEDTLS_ECP_DP_CURVE25519, "x25519")) goto done;
+		if (!bench_dh(idx, dh_group14_p, sizeof(dh_group14_p), "dh group14 modexp")) goto done;
+		if (what & BENCH_KEX_BIG)
+			bench_dh(idx, dh_group16_p, sizeof(dh_group16_p), "dh group16 modexp");
+	}
+
+done:
+	if (bench_cancelled(idx))
+		printf_s(idx, "sshbench: cancelled\r\n");
+	free(buf);
+}
+
+/* ---- handshakes ---- */
+
+/* time full key exchanges (no auth) against a server with each profile,
+   or just the one asked for */
+void bench_handshake(int idx, const char* hostport, int profile, int rounds)
+{
+	int p = profile < 0 ? 0 : profile;
+	const char* name;
+	int i;
+
+	for (; (name = bench_profile(p)) != NULL; p++)
+	{
+		long best = -1, total = 0;
+		int done = 0;
+		char algos[160];
+
+		for (i = 0; i < rounds && !bench_cancelled(idx); i++)
+		{
+			long ms = bench_connect(idx, hostport, p, algos, sizeof(algos));
+			if (ms < 0) break;
+			total += ms;
+			if (best < 0 || ms < best) best = ms;
+			done++;
+		}
+
+		if (bench_cancelled(idx))
+		{
+			printf_s(idx, "sshbench: cancelled\r\n");
+			return;
+		}
+
+		if (done == 0)
+			printf_s(idx, "  %-10s handshake failed\r\n", name);
+		else
+			printf_s(idx, "  %-10s best %ld, avg %ld ms  %s\r\n",
+				name, best, total / done, algos);
+
+		if (profile >= 0)
+			break;
+	}
+}
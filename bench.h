@@ -0,0 +1,28 @@
+/*
+ * SevenTTY - crypto and handshake benchmarks
+ */
+
+#pragma once
+
+/* what bench_crypto() runs */
+#define BENCH_SYM     1   /* ciphers and MACs */
+#define BENCH_KEX     2   /* ECDH and DH group14 */
+#define BENCH_KEX_BIG 4   /* also DH group16, minutes on a 68030 */
+
+void bench_crypto(int idx, int what);
+void bench_handshake(int idx, const char* hostport, int profile, int rounds);
+
+/* All bench.c needs from the rest of the app besides printf_s, so it
+   builds without app.h; tools/bench_host.c has Unix versions. */
+
+/* Ctrl+C or the tab closing (shell.c) */
+int bench_cancelled(int idx);
+
+/* name of algorithm profile n, NULL past the last (net.c) */
+const char* bench_profile(int profile);
+
+/* connect and run only the key exchange with the given profile; returns
+   how long that took in ms, or -1, and puts the kex, host key, cipher
+   and MAC agreed in algos (net.c) */
+long bench_connect(int idx, const char* hostport, int profile,
+                   char* algos, int algos_size);
@@ -0,0 +1,151 @@
+/*
+ * SevenTTY - HTTP chunked transfer coding
+ *
+ * Undoes Transfer-Encoding: chunked as the body streams in. Chunk data
+ * is handed on where it sits in the receive buffer, so the only work
+ * per chunk is reading its size line; nothing is copied. The decoder
+ * keeps its place between calls, so size lines, CRLFs and trailers can
+ * be split across reads anywhere.
+ */
+
+#include "chunked.h"
+
+#include <string.h>
+
+/* decoder states */
+enum {
+	C_SIZE,       /* hex chunk size */
+	C_EXT,        /* chunk extensions, up to the end of the line */
+	C_SIZE_LF,    /* LF after the size line's CR */
+	C_DATA,       /* chunk data */
+	C_DATA_CR,    /* CRLF after the data */
+	C_DATA_LF,
+	C_TRAILER,    /* trailer lines, up to an empty one */
+	C_DONE,
+	C_BAD
+};
+
+void chunked_init(struct chunked* d)
+{
+	memset(d, 0, sizeof(*d));
+	d->state = C_SIZE;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* the size line is over: data follows, or the trailers for size 0 */
+static int size_line_done(struct chunked* d)
+{
+	if (d->digits == 0)
+		return C_BAD;
+	d->line_len = 0;
+	return d->left ? C_DATA : C_TRAILER;
+}
+
+int chunked_feed(struct chunked* d, int session_idx, const char* in, size_t len,
+                 size_t* used, const struct filter_stage* next)
+{
+	const char* p = in;
+	const char* end = in + len;
+
+	while (p < end && d->state != C_DONE && d->state != C_BAD)
+	{
+		switch (d->state)
+		{
+			case C_SIZE:
+			{
+				int v = hex_value(*p);
+
+				if (v >= 0)
+				{
+					if (d->left > 0x0FFFFFFFUL)
+						d->state = C_BAD;  /* too big for us */
+					d->left = (d->left << 4) | v;
+					d->digits++;
+				}
+				else if (*p == ';' || *p == ' ' || *p == '\t')
+					d->state = C_EXT;
+				else if (*p == '\r')
+					d->state = C_SIZE_LF;
+				else if (*p == '\n')
+					d->state = size_line_done(d);
+				else
+					d->state = C_BAD;
+				p++;
+				break;
+			}
+
+			case C_EXT:
+			{
+				const char* lf = memchr(p, '\n', end - p);
+
+				if (lf == NULL)
+				{
+					p = end;
+					break;
+				}
+				p = lf + 1;
+				d->state = size_line_done(d);
+				break;
+			}
+
+			case C_SIZE_LF:
+				d->state = (*p++ == '\n') ? size_line_done(d) : C_BAD;
+				break;
+
+			case C_DATA:
+			{
+				size_t n = end - p;
+
+				if (n > d->left)
+					n = d->left;
+				filter_emit(session_idx, next, p, n);
+				p += n;
+				d->left -= n;
+				if (d->left == 0)
+					d->state = C_DATA_CR;
+				break;
+			}
+
+			case C_DATA_CR:
+				/* a bare LF is let through, as elsewhere */
+				if (*p == '\r')
+					d->state = C_DATA_LF;
+				else if (*p == '\n')
+					d->state = C_SIZE;
+				else
+					d->state = C_BAD;
+				d->digits = 0;
+				p++;
+				break;
+
+			case C_DATA_LF:
+				d->state = (*p++ == '\n') ? C_SIZE : C_BAD;
+				break;
+
+			case C_TRAILER:
+				if (*p == '\n')
+				{
+					if (d->line_len == 0)
+						d->state = C_DONE;
+					d->line_len = 0;
+				}
+				else if (*p != '\r')
+					d->line_len++;
+				p++;
+				break;
+		}
+	}
+
+	*used = p - in;
+
+	if (d->state == C_BAD)
+		return CHUNKED_ERROR;
+	return (d->state == C_DONE) ? CHUNKED_END : CHUNKED_MORE;
+}
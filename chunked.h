@@ -0,0 +1,29 @@
+/*
+ * SevenTTY - HTTP chunked transfer coding
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "filter.h"
+
+/* chunked_feed() results */
+#define CHUNKED_MORE   0  /* input used up, the body goes on */
+#define CHUNKED_END    1  /* last chunk and trailers seen, *used says where */
+#define CHUNKED_ERROR -1  /* malformed framing */
+
+struct chunked {
+	int state;
+	unsigned long left;   /* chunk size, then data bytes still due */
+	int digits;           /* hex digits in the size line so far */
+	int line_len;         /* bytes in the current trailer line */
+};
+
+void chunked_init(struct chunked* d);
+
+/* Strip the framing from a piece of a chunked body, passing the data
+   on to next where it lies in the input. Pieces may split the body
+   anywhere. On CHUNKED_END, bytes past *used are not part of it. */
+int chunked_feed(struct chunked* d, int session_idx, const char* in, size_t len,
+                 size_t* used, const struct filter_stage* next);
@@ -979,6 +979,180 @@ void draw_tab_bar(struct window_context* wc)
 	RGBBackColor(&save_rgb_bg);
 }
 
+/* ---- local echo prediction ---- */
+
+/* Over slow links each keystroke would otherwise take a round trip to
+   show up. Printable keys typed at something that looks like a shell
+   prompt are drawn at once as underlined tentative cells; the session
+   thread then checks them against what the server echoes into vterm.
+   A matching cell confirms the prediction, anything else rolls them all
+   back. Predictions are only drawn once the server has echoed typing at
+   a prompt (trust), and are dropped again after a mispredict. Other keys
+   (Return, arrows, control codes) hold new predictions off until the
+   server answers them. */
+
+#define PREDICT_TIMEOUT (60L * 3)
+
+static void predict_damage(struct session* s, int session_idx)
+{
+	struct window_context* wc = window_for_session(session_idx);
+
+	if (wc == NULL || session_idx != wc->session_ids[wc->active_session_idx] || wc->win == NULL)
+		return;
+
+	mark_dirty(s, s->predict_row, s->predict_row + 1);
+	SetPort(wc->win);
+	{
+		Rect r = cell_rect(wc, 0, s->predict_row, wc->win->portRect);
+		r.right = wc->win->portRect.right - 15;
+		InvalRect(&r);
+	}
+	wc->needs_redraw = 1;
+}
+
+static void predict_rollback(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->predict_len == 0) return;
+	predict_damage(s, session_idx);
+	s->predict_len = 0;
+	s->predict_trust = 0;
+}
+
+/* the row up to the cursor has a "$ ", "# ", "% " or "> " in it */
+static int at_shell_prompt(struct session* s)
+{
+	VTermScreenCell cell;
+	VTermPos pos;
+	uint32_t after = 0;
+
+	pos.row = s->cursor_y;
+	for (pos.col = s->cursor_x - 1; pos.col >= 0; pos.col--)
+	{
+		uint32_t ch;
+
+		if (!vterm_screen_get_cell(s->vts, pos, &cell)) return 0;
+		ch = cell.chars[0];
+		if (after == ' ' && (ch == '$' || ch == '#' || ch == '%' || ch == '>'))
+			return 1;
+		after = ch ? ch : ' ';
+	}
+
+	return 0;
+}
+
+/* a key is about to go to the server: c printable = predict it,
+   anything else = stop predicting until the server answers */
+void predict_key(int session_idx, unsigned char c)
+{
+	struct session* s = &sessions[session_idx];
+	struct window_context* wc = window_for_session(session_idx);
+
+	if (!prefs.local_echo || wc == NULL || s->vts == NULL) return;
+	if (s->type != SESSION_SSH && s->type != SESSION_TELNET) return;
+
+	if (c < 32 || c > 126)
+	{
+		s->predict_hold = 1;
+		return;
+	}
+
+	if (s->predict_hold || s->alt_screen || s->scroll_offset > 0 || s->paste_data != NULL)
+		return;
+
+	if (s->predict_len == 0)
+	{
+		if (!at_shell_prompt(s)) return;
+		s->predict_row = s->cursor_y;
+		s->predict_col = s->cursor_x;
+		s->predict_since = TickCount();
+	}
+	else if (s->cursor_y != s->predict_row)
+	{
+		return;
+	}
+
+	/* never predict a wrap */
+	if (s->predict_len >= PREDICT_MAX || s->predict_col + s->predict_len >= wc->size_x - 1)
+		return;
+
+	s->predict_text[s->predict_len] = c;
+	s->predict_show[s->predict_len] = s->predict_trust;
+	s->predict_len++;
+
+	if (s->predict_trust)
+		predict_damage(s, session_idx);
+}
+
+/* match predictions against the screen. from_network: server output was
+   just written (session thread); otherwise only the timeout is checked */
+void predict_check(int session_idx, int from_network)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (from_network && s->predict_len == 0)
+		s->predict_hold = 0;
+
+	while (s->predict_len > 0)
+	{
+		VTermScreenCell cell;
+		VTermPos pos;
+
+		if (s->cursor_y < s->predict_row ||
+		    (s->cursor_y == s->predict_row && s->cursor_x <= s->predict_col))
+			break;  /* server hasn't got this far yet */
+
+		pos.row = s->predict_row;
+		pos.col = s->predict_col;
+		if (!vterm_screen_get_cell(s->vts, pos, &cell) ||
+		    cell.chars[0] != (unsigned char)s->predict_text[0])
+		{
+			predict_rollback(session_idx);
+			return;
+		}
+
+		/* confirmed: the real cell takes over from here */
+		if (s->predict_show[0]) predict_damage(s, session_idx);
+		s->predict_trust = 1;
+		s->predict_len--;
+		memmove(s->predict_text, s->predict_text + 1, s->predict_len);
+		memmove(s->predict_show, s->predict_show + 1, s->predict_len);
+		s->predict_col++;
+		s->predict_since = TickCount();
+	}
+
+	if (s->predict_len > 0 && (long)(TickCount() - s->predict_since) > PREDICT_TIMEOUT)
+		predict_rollback(session_idx);
+
+	if (from_network && s->predict_len == 0)
+		s->predict_hold = 0;
+}
+
+/* tentative cell over the live screen, for the renderers */
+static void predict_overlay(struct session* s, VTermPos pos, VTermScreenCell* cell)
+{
+	int i = pos.col - s->predict_col;
+
+	if (pos.row != s->predict_row || i < 0 || i >= s->predict_len || !s->predict_show[i])
+		return;
+
+	cell->chars[0] = (unsigned char)s->predict_text[i];
+	cell->chars[1] = 0;
+	cell->width = 1;
+	cell->attrs.underline = 1;
+}
+
+/* where to draw the cursor: after the last shown prediction */
+static int cursor_col(struct session* s)
+{
+	int i = s->predict_len;
+
+	if (i == 0 || s->cursor_y != s->predict_row) return s->cursor_x;
+	while (i > 0 && !s->predict_show[i - 1]) i--;
+	return MAX(s->cursor_x, s->predict_col + i);
+}
+
 /* Get a cell accounting for scroll offset.
  * display_row is the row on screen (0..size_y-1).
  * If scrolled back, top rows come from the scrollback buffer,
@@ -1036,9 +1210,12 @@ static int get_cell_scrolled(struct window_context* wc, int display_row, int col
 	{
 		/* live screen row */
 		VTermPos pos;
+		int ok;
 		pos.row = display_row - s->scroll_offset;
 		pos.col = col;
-		return vterm_screen_get_cell(s->vts, pos, cell);
+		ok = vterm_screen_get_cell(s->vts, pos, cell);
+		if (ok && s->predict_len > 0) predict_overlay(s, pos, cell);
+		return ok;
 	}
 }
 
@@ -1394,7 +1571,7 @@ void draw_screen_color(struct window_context* wc, Rect* r)
 	/* do the cursor if needed - InvertRect is atomic, draw directly to window */
 	if (WC_S(wc).cursor_state && WC_S(wc).cursor_visible)
 	{
-		Rect cursor = cell_rect(wc, WC_S(wc).cursor_x, WC_S(wc).cursor_y, wc->win->portRect);
+		Rect cursor = cell_rect(wc, cursor_col(&WC_S(wc)), WC_S(wc).cursor_y, wc->win->portRect);
 		InvertRect(&cursor);
 	}
 
@@ -1567,7 +1744,7 @@ void draw_screen_fast(struct window_context* wc, Rect* r)
 	/* do the cursor if needed */
 	if (WC_S(wc).cursor_state && WC_S(wc).cursor_visible)
 	{
-		Rect cursor = cell_rect(wc, WC_S(wc).cursor_x, WC_S(wc).cursor_y, wc->win->portRect);
+		Rect cursor = cell_rect(wc, cursor_col(&WC_S(wc)), WC_S(wc).cursor_y, wc->win->portRect);
 		InvertRect(&cursor);
 	}
 
@@ -1750,6 +1927,23 @@ void printf_s(int session_idx, const char* str, ...)
 		vterm_input_write(s->vterm, buf, len);
 }
 
+const struct filter_stage filter_vterm = { vterm_sink, NULL };
+
+/* feed a span to the session's terminal */
+void vterm_sink(int session_idx, const char* buf, size_t len,
+                const struct filter_stage* next)
+{
+	struct session* s = &sessions[session_idx];
+
+	while (len > 0 && s->vterm != NULL)
+	{
+		size_t written = vterm_input_write(s->vterm, buf, len);
+		if (written == 0) break;
+		buf += written;
+		len -= written;
+	}
+}
+
 int bell(void* user)
 {
 	SysBeep(30);
@@ -1821,7 +2015,13 @@ int settermprop(VTermProp prop, VTermValue *val, void *user)
 			{
 				char mr_title[256];
 				int mr_len = utf8_to_macroman(val->string.str, val->string.len, mr_title, sizeof(mr_title));
-				if (wc != NULL && idx == wc->session_ids[wc->active_session_idx])
+				if (s->paste_titled)
+				{
+					/* paste progress has the title bar; this goes up after */
+					memcpy(s->paste_title, mr_title, mr_len);
+					s->paste_title[mr_len] = '\0';
+				}
+				else if (wc != NULL && idx == wc->session_ids[wc->active_session_idx])
 					set_window_title(wc->win, mr_title, mr_len);
 				/* also update tab label */
 				if (mr_len > 63) mr_len = 63;
@@ -1841,6 +2041,10 @@ int settermprop(VTermProp prop, VTermValue *val, void *user)
 			}
 			return 1;
 		case VTERM_PROP_ALTSCREEN: // bool
+			/* full screen apps: no echo prediction */
+			s->alt_screen = val->boolean;
+			predict_rollback(idx);
+			return 1;
 		case VTERM_PROP_ICONNAME: // string
 		case VTERM_PROP_REVERSE: //bool
 		case VTERM_PROP_CURSORSHAPE: // number
@@ -1855,7 +2059,7 @@ int settermprop(VTermProp prop, VTermValue *val, void *user)
 void output_callback(const char *s, size_t len, void *user)
 {
 	int idx = (int)(intptr_t)user;
-	ssh_write_s(idx, (char*)s, len);
+	session_send(idx, s, len);
 }
 
 // local shell sessions don't send vterm output anywhere
@@ -1912,6 +2116,10 @@ static int sb_pushline(int cols, const VTermScreenCell *cells, void *user)
 	s->sb_head = (s->sb_head + 1) % SCROLLBACK_LINES;
 	if (s->sb_count < SCROLLBACK_LINES) s->sb_count++;
 
+	/* predictions move up with the screen */
+	if (s->predict_len > 0 && --s->predict_row < 0)
+		s->predict_len = 0;
+
 	/* if user is scrolled back, keep their position stable */
 	if (s->scroll_offset > 0 && s->scroll_offset < s->sb_count)
 		s->scroll_offset++;
@@ -44,5 +44,7 @@ void scroll_reset(struct window_context* wc);
 void output_callback(const char *s, size_t len, void *user);
 
 void console_mark_full_dirty(int session_idx);
+void predict_key(int session_idx, unsigned char c);
+void predict_check(int session_idx, int from_network);
 void sync_scrollbar(struct window_context* wc);
 void cleanup_row_gworld(void);
@@ -0,0 +1,125 @@
+/*
+ * SevenTTY - streaming receive filters
+ *
+ * Filters sit between the network reads and libvterm. They hand clean
+ * spans of their input straight to a sink instead of copying them into
+ * a second buffer, so the common case costs one scan and no memcpy.
+ * They reach the session only through filter_state(), which keeps
+ * this file free of Toolbox headers (see tools/filter_test.c).
+ */
+
+#include "filter.h"
+
+#include <string.h>
+
+/* Translate ANSI.SYS escape sequences to DEC VT equivalents.
+   ESC[s (save cursor) -> ESC 7 (DECSC)
+   ESC[u (restore cursor) -> ESC 8 (DECRC)
+   vterm interprets ESC[s as DECSLRM (set left/right margins) which
+   breaks BBS ANSI art that uses ESC[s/u for cursor save/restore.
+   Runs between escapes go to the next stage untouched; only the bytes
+   around an ESC are looked at one at a time. Uses per-session state
+   to handle sequences split across chunks. */
+void ansi_sys_filter(int session_idx, const char* in, size_t len,
+                     const struct filter_stage* next)
+{
+	struct filter_state* st = filter_state(session_idx);
+	const char* end = in + len;
+
+	while (in < end)
+	{
+		switch (st->ansi_fixup)
+		{
+			case 0: /* normal: skip ahead to the next ESC */
+			{
+				const char* esc = memchr(in, '\033', end - in);
+
+				if (esc == NULL)
+				{
+					filter_emit(session_idx, next, in, end - in);
+					return;
+				}
+
+				if (esc > in)
+					filter_emit(session_idx, next, in, esc - in);
+
+				st->ansi_fixup = 1;
+				in = esc + 1;
+				break;
+			}
+
+			case 1: /* saw ESC */
+				if (*in == '[')
+				{
+					st->ansi_fixup = 2;
+					in++;
+				}
+				else
+				{
+					/* not ESC[, emit the ESC and reprocess this byte */
+					filter_emit(session_idx, next, "\033", 1);
+					st->ansi_fixup = 0;
+				}
+				break;
+
+			case 2: /* saw ESC[ */
+				if (*in == 's')
+				{
+					filter_emit(session_idx, next, "\0337", 2);
+					in++;
+				}
+				else if (*in == 'u')
+				{
+					filter_emit(session_idx, next, "\0338", 2);
+					in++;
+				}
+				else
+				{
+					/* ordinary CSI, the rest rides along with the next span.
+					   An ESC right after ESC[ is passed on as it is rather
+					   than starting a sequence, as the copying fixup did. */
+					filter_emit(session_idx, next, "\033[", 2);
+					if (*in == '\033')
+						filter_emit(session_idx, next, in++, 1);
+				}
+				st->ansi_fixup = 0;
+				break;
+		}
+	}
+}
+
+/* convert bare LF to CRLF for vterm display. The LF itself stays in
+   the following span, so only a lone CR is ever emitted separately. */
+void crlf_filter(int session_idx, const char* in, size_t len,
+                 const struct filter_stage* next)
+{
+	struct filter_state* st = filter_state(session_idx);
+	const char* end = in + len;
+	const char* run = in;
+
+	while (in < end)
+	{
+		const char* lf = memchr(in, '\n', end - in);
+
+		if (lf == NULL)
+			break;
+
+		if ((lf > in) ? lf[-1] != '\r' : !st->crlf_prev_cr)
+		{
+			if (lf > run)
+				filter_emit(session_idx, next, run, lf - run);
+			filter_emit(session_idx, next, "\r", 1);
+			run = lf;
+		}
+
+		/* an LF at the start of the rest follows this one, not a CR */
+		st->crlf_prev_cr = 0;
+		in = lf + 1;
+	}
+
+	if (end > run)
+		filter_emit(session_idx, next, run, end - run);
+
+	if (len > 0)
+		st->crlf_prev_cr = (end[-1] == '\r');
+}
@@ -0,0 +1,44 @@
+/*
+ * SevenTTY - streaming receive filters
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* One stage of a receive pipeline. Each stage scans its input once and
+   passes spans on to the next stage as it goes, so a whole chain runs
+   in a single pass with no intermediate buffers. The last stage (the
+   sink) gets next == NULL. */
+struct filter_stage;
+
+typedef void (*filter_fn)(int session_idx, const char* buf, size_t len,
+                          const struct filter_stage* next);
+
+struct filter_stage {
+	filter_fn fn;
+	const struct filter_stage* next;
+};
+
+/* What the filters carry over between spans, one per session. */
+struct filter_state {
+	unsigned char ansi_fixup;    /* 0=normal, 1=saw ESC, 2=saw ESC[ */
+	unsigned char crlf_prev_cr;  /* last received byte was CR */
+};
+
+/* the session's filter state (kept in sessions[] by app.c) */
+struct filter_state* filter_state(int session_idx);
+
+/* push a span into a stage */
+#define filter_emit(session_idx, stage, buf, len) \
+	((stage)->fn((session_idx), (buf), (len), (stage)->next))
+
+/* sink: feed spans to the session's terminal (console.c) */
+extern const struct filter_stage filter_vterm;
+
+void vterm_sink(int session_idx, const char* buf, size_t len,
+                const struct filter_stage* next);
+void ansi_sys_filter(int session_idx, const char* in, size_t len,
+                     const struct filter_stage* next);
+void crlf_filter(int session_idx, const char* in, size_t len,
+                 const struct filter_stage* next);
@@ -0,0 +1,169 @@
+/*
+ * SevenTTY - telnet IAC parser
+ *
+ * The telnet receive filter: IAC sequences come out, bare LFs get their
+ * CR, and runs of plain data go to the next stage in place. Answering
+ * the negotiation is left to telnet.c through the telnet_handle_*
+ * hooks, and the session is reached only through iac_state() and
+ * filter_state(), so this file builds on a host (see
+ * tools/telnet_filter_test.c).
+ */
+
+#include "iac.h"
+
+#include <string.h>
+
+/* parser states */
+#define TS_DATA    0
+#define TS_IAC     1
+#define TS_WILL    2
+#define TS_WONT    3
+#define TS_DO      4
+#define TS_DONT    5
+#define TS_SB      6
+#define TS_SB_IAC  7
+
+void telnet_filter(int session_idx, const char* buf, size_t len,
+                   const struct filter_stage* next)
+{
+	struct iac_state* t = iac_state(session_idx);
+	struct filter_state* f = filter_state(session_idx);
+	const unsigned char* in = (const unsigned char*)buf;
+	const unsigned char* end = in + len;
+	const unsigned char* run = in;   /* start of data not yet passed on */
+
+	while (in < end)
+	{
+		unsigned char c = *in;
+
+		if (t->state == TS_DATA)
+		{
+			/* skip ahead to the next IAC; only LFs in between need a look */
+			const unsigned char* iac = memchr(in, TEL_IAC, end - in);
+			const unsigned char* stop = iac ? iac : end;
+			const unsigned char* lf;
+
+			while ((lf = memchr(in, '\n', stop - in)) != NULL)
+			{
+				if ((lf > in) ? lf[-1] != '\r' : !f->crlf_prev_cr)
+				{
+					/* the LF itself starts the next run */
+					if (lf > run)
+						filter_emit(session_idx, next, (const char*)run, lf - run);
+					filter_emit(session_idx, next, "\r", 1);
+					run = lf;
+				}
+				f->crlf_prev_cr = 0;
+				in = lf + 1;
+			}
+
+			if (stop > in)
+				f->crlf_prev_cr = (stop[-1] == '\r');
+
+			if (iac == NULL)
+			{
+				in = end;
+				break;
+			}
+
+			if (iac > run)
+				filter_emit(session_idx, next, (const char*)run, iac - run);
+			t->state = TS_IAC;
+			f->crlf_prev_cr = 0;
+			in = iac + 1;
+			run = in;
+			continue;
+		}
+
+		switch (t->state)
+		{
+			case TS_IAC:
+				switch (c)
+				{
+					case TEL_IAC:
+						filter_emit(session_idx, next, "\377", 1);
+						t->state = TS_DATA;
+						break;
+					case TEL_WILL:
+						t->state = TS_WILL;
+						break;
+					case TEL_WONT:
+						t->state = TS_WONT;
+						break;
+					case TEL_DO:
+						t->state = TS_DO;
+						break;
+					case TEL_DONT:
+						t->state = TS_DONT;
+						break;
+					case TEL_SB:
+						t->state = TS_SB;
+						t->sb_len = 0;
+						break;
+					default:
+						/* NOP, BRK, etc. — ignore */
+						t->state = TS_DATA;
+						break;
+				}
+				break;
+
+			case TS_WILL:
+				telnet_handle_will(session_idx, c);
+				t->state = TS_DATA;
+				break;
+
+			case TS_WONT:
+				/* acknowledge, nothing to do */
+				t->state = TS_DATA;
+				break;
+
+			case TS_DO:
+				telnet_handle_do(session_idx, c);
+				t->state = TS_DATA;
+				break;
+
+			case TS_DONT:
+				t->state = TS_DATA;
+				break;
+
+			case TS_SB:
+				if (c == TEL_IAC)
+					t->state = TS_SB_IAC;
+				else if (t->sb_len < (int)sizeof(t->sb_buf))
+					t->sb_buf[t->sb_len++] = c;
+				break;
+
+			case TS_SB_IAC:
+				if (c == TEL_SE)
+				{
+					const struct filter_stage* rest;
+
+					t->state = TS_DATA;
+					rest = telnet_handle_sb(session_idx, t->sb_buf, t->sb_len);
+					if (rest != NULL)
+					{
+						/* the rest of this read is already compressed */
+						f->crlf_prev_cr = 0;
+						filter_emit(session_idx, rest, (const char*)in + 1,
+						            end - (in + 1));
+						return;
+					}
+				}
+				else
+				{
+					/* not SE, put byte into SB buffer */
+					if (t->sb_len < (int)sizeof(t->sb_buf))
+						t->sb_buf[t->sb_len++] = c;
+					t->state = TS_SB;
+				}
+				break;
+		}
+
+		f->crlf_prev_cr = 0;
+		in++;
+		run = in;
+	}
+
+	if (in > run)
+		filter_emit(session_idx, next, (const char*)run, in - run);
+}
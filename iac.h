@@ -0,0 +1,41 @@
+/*
+ * SevenTTY - telnet IAC parser
+ */
+
+#pragma once
+
+#include "filter.h"
+
+/* telnet commands */
+#define TEL_SE    240
+#define TEL_NOP   241
+#define TEL_BRK   243
+#define TEL_SB    250
+#define TEL_WILL  251
+#define TEL_WONT  252
+#define TEL_DO    253
+#define TEL_DONT  254
+#define TEL_IAC   255
+
+/* What the parser carries over between reads, one per session. */
+struct iac_state {
+	unsigned char state;          /* IAC parser state */
+	unsigned char sb_buf[64];     /* subnegotiation buffer */
+	int sb_len;
+};
+
+/* the session's parser state (kept in sessions[] by app.c) */
+struct iac_state* iac_state(int session_idx);
+
+/* negotiation, answered by telnet.c */
+void telnet_handle_will(int session_idx, unsigned char opt);
+void telnet_handle_do(int session_idx, unsigned char opt);
+
+/* IAC SB ... IAC SE; returns the stage the rest of the read goes to
+   when the server switches the stream over (MCCP2), else NULL */
+const struct filter_stage* telnet_handle_sb(int session_idx,
+                                            const unsigned char* buf, int len);
+
+/* strips IAC sequences and turns bare LF into CRLF */
+void telnet_filter(int session_idx, const char* buf, size_t len,
+                   const struct filter_stage* next);
@@ -0,0 +1,711 @@
+/*
+ * SevenTTY - streaming inflate
+ *
+ * A small resumable deflate decoder, used for compressed telnet (MCCP2)
+ * and gzip Content-Encoding in wget.
+ * The stream can arrive in pieces of any size: the decoder keeps its
+ * place between calls instead of needing whole blocks. Output is written
+ * straight into the history window and passed on from there, so the
+ * window, sized from the stream header, is the only buffer it needs.
+ */
+
+#include "inflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BITS     15
+#define MAX_LCODES   286
+#define MAX_DCODES   30
+#define FIX_LCODES   288
+#define MAX_WBITS    15   /* 32 KB, the most deflate can refer back */
+
+/* gzip header flags */
+#define GZ_FHCRC     0x02
+#define GZ_FEXTRA    0x04
+#define GZ_FNAME     0x08
+#define GZ_FCOMMENT  0x10
+
+/* decoder states */
+enum {
+	M_HEADER,     /* zlib CMF/FLG */
+	M_GZHEAD,     /* gzip fixed header */
+	M_GZFIELDS,   /* gzip optional extra, name, comment, header crc */
+	M_BLOCK,      /* 3-bit block header */
+	M_STORED,     /* stored block LEN */
+	M_STORED_N,   /* stored block NLEN */
+	M_COPY,       /* stored block data */
+	M_TABLE,      /* dynamic block HLIT/HDIST/HCLEN */
+	M_LENLENS,    /* code length code lengths */
+	M_CODELENS,   /* literal/length and distance code lengths */
+	M_CODEREP,    /* extra bits of a code length repeat */
+	M_LEN,        /* literal/length symbol */
+	M_LENEXT,     /* length extra bits */
+	M_DIST,       /* distance symbol */
+	M_DISTEXT,    /* distance extra bits */
+	M_CHECK,      /* adler32 or gzip crc32/size trailer */
+	M_DONE,
+	M_BAD
+};
+
+/* canonical Huffman code: codes per length and symbols in code order */
+struct huffman {
+	short count[MAX_BITS + 1];
+	short symbol[FIX_LCODES];
+};
+
+struct inflater {
+	int format;
+	int mode;
+	int last;                  /* this block is the final one */
+	unsigned long bitbuf;      /* bits not yet used, LSB first */
+	int bitcnt;
+
+	/* block state */
+	unsigned long stored_left;
+	int nlen, ndist, ncode;
+	int index;                 /* code lengths read so far */
+	int sym;                   /* symbol waiting for its extra bits */
+	int length;                /* match length */
+	int dist;                  /* match distance */
+	short lengths[MAX_LCODES + MAX_DCODES];
+	struct huffman lencode;
+	struct huffman distcode;
+
+	/* history, and the output not yet passed on */
+	unsigned char* window;
+	unsigned long wsize;       /* power of two */
+	unsigned long wpos;        /* next byte goes here */
+	unsigned long whave;       /* history bytes that are valid */
+	unsigned long wsent;       /* window[wsent..wpos) still to pass on */
+
+	unsigned long adler;
+	unsigned long crc;         /* gzip: running crc32, pre-inverted */
+	unsigned long total;       /* gzip: output length */
+	unsigned long check;
+	unsigned long isize;
+	int check_n;
+	int gzflags;
+	const char* msg;
+};
+
+static const short len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577 };
+static const short dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const unsigned char lenlen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/* ---- setup ---- */
+
+static int inflate_window(struct inflater* z, int wbits)
+{
+	z->wsize = 1UL << wbits;
+	z->window = malloc(z->wsize);
+	if (z->window == NULL)
+	{
+		z->msg = "out of memory";
+		return 0;
+	}
+	return 1;
+}
+
+struct inflater* inflate_new(int format)
+{
+	struct inflater* z = malloc(sizeof(struct inflater));
+
+	if (z == NULL) return NULL;
+	memset(z, 0, sizeof(*z));
+	z->format = format;
+	z->adler = 1;
+
+	if (format == INFLATE_ZLIB)
+		z->mode = M_HEADER;   /* window size comes from the header */
+	else
+	{
+		/* gzip doesn't say, so it gets the full window like raw */
+		z->mode = (format == INFLATE_GZIP) ? M_GZHEAD : M_BLOCK;
+		z->crc = 0xFFFFFFFFUL;
+		if (!inflate_window(z, MAX_WBITS))
+		{
+			free(z);
+			return NULL;
+		}
+	}
+
+	return z;
+}
+
+void inflate_free(struct inflater* z)
+{
+	if (z == NULL) return;
+	if (z->window != NULL) free(z->window);
+	free(z);
+}
+
+const char* inflate_error(const struct inflater* z)
+{
+	return (z != NULL && z->msg != NULL) ? z->msg : "corrupt stream";
+}
+
+/* ---- output ---- */
+
+static void adler_update(struct inflater* z, const unsigned char* p, unsigned long len)
+{
+	unsigned long a = z->adler & 0xFFFF;
+	unsigned long b = z->adler >> 16;
+
+	while (len > 0)
+	{
+		/* 5552 bytes is the most that can't overflow before the mod */
+		unsigned long n = len < 5552 ? len : 5552;
+
+		len -= n;
+		while (n-- > 0)
+		{
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+
+	z->adler = (b << 16) | a;
+}
+
+static unsigned long crc_table[256];
+static int crc_table_ready = 0;
+
+static void crc_update(struct inflater* z, const unsigned char* p, unsigned long len)
+{
+	unsigned long c = z->crc;
+
+	if (!crc_table_ready)
+	{
+		int i, k;
+
+		for (i = 0; i < 256; i++)
+		{
+			unsigned long t = (unsigned long)i;
+			for (k = 0; k < 8; k++)
+				t = (t & 1) ? 0xEDB88320UL ^ (t >> 1) : t >> 1;
+			crc_table[i] = t;
+		}
+		crc_table_ready = 1;
+	}
+
+	while (len-- > 0)
+		c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	z->crc = c;
+}
+
+/* pass the window's new bytes to the next stage */
+static void inflate_flush(struct inflater* z, int session_idx,
+                          const struct filter_stage* next)
+{
+	unsigned long n = z->wpos - z->wsent;
+
+	if (n == 0) return;
+	if (z->format == INFLATE_ZLIB)
+		adler_update(z, z->window + z->wsent, n);
+	else if (z->format == INFLATE_GZIP)
+	{
+		crc_update(z, z->window + z->wsent, n);
+		z->total += n;
+	}
+	filter_emit(session_idx, next, (const char*)z->window + z->wsent, n);
+	z->wsent = z->wpos;
+}
+
+/* flush and start over when the window is full */
+#define WRAP() \
+	do { \
+		if (z->wpos == z->wsize) \
+		{ \
+			inflate_flush(z, session_idx, next); \
+			z->wpos = 0; \
+			z->wsent = 0; \
+		} \
+	} while (0)
+
+/* step past the byte just written */
+#define ADVANCE() \
+	do { \
+		if (z->whave < z->wsize) z->whave++; \
+		z->wpos++; \
+		WRAP(); \
+	} while (0)
+
+/* ---- Huffman codes ---- */
+
+/* build a decoding table from code lengths; 0 if over-subscribed */
+static int huffman_build(struct huffman* h, const short* length, int n)
+{
+	short offs[MAX_BITS + 1];
+	int left = 1;
+	int len, sym;
+
+	for (len = 0; len <= MAX_BITS; len++)
+		h->count[len] = 0;
+	for (sym = 0; sym < n; sym++)
+		h->count[length[sym]]++;
+
+	for (len = 1; len <= MAX_BITS; len++)
+	{
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0) return 0;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+
+	for (sym = 0; sym < n; sym++)
+		if (length[sym] != 0)
+			h->symbol[offs[length[sym]]++] = sym;
+
+	return 1;
+}
+
+static void huffman_fixed(struct inflater* z)
+{
+	int sym;
+
+	for (sym = 0; sym < 144; sym++) z->lengths[sym] = 8;
+	for (; sym < 256; sym++) z->lengths[sym] = 9;
+	for (; sym < 280; sym++) z->lengths[sym] = 7;
+	for (; sym < FIX_LCODES; sym++) z->lengths[sym] = 8;
+	huffman_build(&z->lencode, z->lengths, FIX_LCODES);
+
+	for (sym = 0; sym < MAX_DCODES; sym++) z->lengths[sym] = 5;
+	huffman_build(&z->distcode, z->lengths, MAX_DCODES);
+}
+
+/* Decode one symbol from the bits on hand, a bit at a time (codes are
+   packed MSB first). Returns -1 when it needs more bits, which stay
+   put, or -2 for a code that isn't in the table. */
+static int huffman_decode(struct inflater* z, const struct huffman* h)
+{
+	unsigned long bits = z->bitbuf;
+	int code = 0, first = 0, index = 0;
+	int len;
+
+	for (len = 1; len <= MAX_BITS; len++)
+	{
+		int count;
+
+		if (len > z->bitcnt) return -1;
+		code |= (int)(bits & 1);
+		bits >>= 1;
+		count = h->count[len];
+		if (code - count < first)
+		{
+			z->bitbuf >>= len;
+			z->bitcnt -= len;
+			return h->symbol[index + (code - first)];
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+
+	return -2;
+}
+
+/* ---- decoder ---- */
+
+/* get at least n bits into bitbuf, or stop until the next piece */
+#define NEEDBITS(n) \
+	while (z->bitcnt < (n)) \
+	{ \
+		if (in == end) goto out; \
+		z->bitbuf |= (unsigned long)*in++ << z->bitcnt; \
+		z->bitcnt += 8; \
+	}
+#define PULLBYTE() \
+	do { \
+		if (in == end) goto out; \
+		z->bitbuf |= (unsigned long)*in++ << z->bitcnt; \
+		z->bitcnt += 8; \
+	} while (0)
+#define BITS(n) ((int)(z->bitbuf & ((1UL << (n)) - 1)))
+#define DROPBITS(n) (z->bitbuf >>= (n), z->bitcnt -= (n))
+#define BAD(m) do { z->msg = (m); z->mode = M_BAD; goto out; } while (0)
+
+int inflate_feed(struct inflater* z, int session_idx, const char* buf, size_t len,
+                 size_t* used, const struct filter_stage* next)
+{
+	const unsigned char* in = (const unsigned char*)buf;
+	const unsigned char* end = in + len;
+	int sym;
+
+	while (z->mode != M_DONE && z->mode != M_BAD)
+	{
+		switch (z->mode)
+		{
+			case M_HEADER:
+			{
+				int cmf, flg;
+
+				NEEDBITS(16);
+				cmf = BITS(8);
+				flg = (int)((z->bitbuf >> 8) & 0xFF);
+				DROPBITS(16);
+				if ((cmf & 15) != 8 || ((cmf << 8) | flg) % 31 != 0)
+					BAD("bad zlib header");
+				if (flg & 0x20)
+					BAD("preset dictionary");
+				if ((cmf >> 4) + 8 > MAX_WBITS)
+					BAD("window too large");
+				if (!inflate_window(z, (cmf >> 4) + 8))
+					BAD("out of memory");
+				z->mode = M_BLOCK;
+				break;
+			}
+
+			case M_GZHEAD:
+				/* ID1 ID2 CM FLG; MTIME XFL OS are skipped */
+				while (z->check_n < 10)
+				{
+					int c;
+
+					NEEDBITS(8);
+					c = BITS(8);
+					DROPBITS(8);
+					if ((z->check_n == 0 && c != 0x1F) || (z->check_n == 1 && c != 0x8B) ||
+					    (z->check_n == 2 && c != 8) || (z->check_n == 3 && (c & 0xE0)))
+						BAD("bad gzip header");
+					if (z->check_n == 3)
+						z->gzflags = c;
+					z->check_n++;
+				}
+				z->check_n = 0;
+				z->mode = M_GZFIELDS;
+				break;
+
+			case M_GZFIELDS:
+				/* each optional field clears its flag once it's passed */
+				if (z->gzflags & GZ_FEXTRA)
+				{
+					if (z->check_n == 0)
+					{
+						NEEDBITS(16);
+						z->stored_left = (unsigned long)BITS(16);
+						DROPBITS(16);
+						z->check_n = 1;
+					}
+					while (z->stored_left > 0)
+					{
+						NEEDBITS(8);
+						DROPBITS(8);
+						z->stored_left--;
+					}
+					z->check_n = 0;
+					z->gzflags &= ~GZ_FEXTRA;
+				}
+				while (z->gzflags & GZ_FNAME)
+				{
+					NEEDBITS(8);
+					if (BITS(8) == 0) z->gzflags &= ~GZ_FNAME;
+					DROPBITS(8);
+				}
+				while (z->gzflags & GZ_FCOMMENT)
+				{
+					NEEDBITS(8);
+					if (BITS(8) == 0) z->gzflags &= ~GZ_FCOMMENT;
+					DROPBITS(8);
+				}
+				if (z->gzflags & GZ_FHCRC)
+				{
+					NEEDBITS(16);
+					DROPBITS(16);
+					z->gzflags &= ~GZ_FHCRC;
+				}
+				z->mode = M_BLOCK;
+				break;
+
+			case M_BLOCK:
+				NEEDBITS(3);
+				z->last = BITS(1);
+				DROPBITS(1);
+				switch (BITS(2))
+				{
+					case 0:
+						z->mode = M_STORED;
+						break;
+					case 1:
+						huffman_fixed(z);
+						z->mode = M_LEN;
+						break;
+					case 2:
+						z->mode = M_TABLE;
+						break;
+					default:
+						DROPBITS(2);
+						BAD("bad block type");
+				}
+				DROPBITS(2);
+				break;
+
+			case M_STORED:
+				/* byte align; a no-op if we stopped here before */
+				DROPBITS(z->bitcnt & 7);
+				NEEDBITS(16);
+				z->stored_left = (unsigned long)BITS(16);
+				DROPBITS(16);
+				z->mode = M_STORED_N;
+				break;
+
+			case M_STORED_N:
+				NEEDBITS(16);
+				if ((unsigned long)BITS(16) != (~z->stored_left & 0xFFFF))
+					BAD("bad stored block length");
+				DROPBITS(16);
+				z->mode = M_COPY;
+				break;
+
+			case M_COPY:
+				/* whole bytes already pulled into bitbuf come first */
+				while (z->stored_left > 0 && z->bitcnt >= 8)
+				{
+					z->window[z->wpos] = (unsigned char)BITS(8);
+					DROPBITS(8);
+					z->stored_left--;
+					ADVANCE();
+				}
+				while (z->stored_left > 0 && in < end)
+				{
+					unsigned long n = z->wsize - z->wpos;
+
+					if (n > z->stored_left) n = z->stored_left;
+					if (n > (unsigned long)(end - in)) n = end - in;
+					memcpy(z->window + z->wpos, in, n);
+					in += n;
+					z->stored_left -= n;
+					z->whave += n;
+					if (z->whave > z->wsize) z->whave = z->wsize;
+					z->wpos += n;
+					WRAP();
+				}
+				if (z->stored_left > 0) goto out;
+				z->mode = z->last ? M_CHECK : M_BLOCK;
+				break;
+
+			case M_TABLE:
+				NEEDBITS(14);
+				z->nlen = BITS(5) + 257;
+				DROPBITS(5);
+				z->ndist = BITS(5) + 1;
+				DROPBITS(5);
+				z->ncode = BITS(4) + 4;
+				DROPBITS(4);
+				if (z->nlen > MAX_LCODES || z->ndist > MAX_DCODES)
+					BAD("bad code counts");
+				z->index = 0;
+				z->mode = M_LENLENS;
+				break;
+
+			case M_LENLENS:
+				while (z->index < z->ncode)
+				{
+					NEEDBITS(3);
+					z->lengths[lenlen_order[z->index++]] = BITS(3);
+					DROPBITS(3);
+				}
+				while (z->index < 19)
+					z->lengths[lenlen_order[z->index++]] = 0;
+				if (!huffman_build(&z->lencode, z->lengths, 19))
+					BAD("bad code length code");
+				z->index = 0;
+				z->mode = M_CODELENS;
+				break;
+
+			case M_CODELENS:
+				while (z->index < z->nlen + z->ndist)
+				{
+					sym = huffman_decode(z, &z->lencode);
+					if (sym == -1)
+					{
+						PULLBYTE();
+						continue;
+					}
+					if (sym < 0)
+						BAD("bad code length");
+					if (sym < 16)
+					{
+						z->lengths[z->index++] = sym;
+						continue;
+					}
+					if (sym == 16 && z->index == 0)
+						BAD("repeat with no length");
+					z->sym = sym;
+					z->mode = M_CODEREP;
+					break;
+				}
+				if (z->mode == M_CODEREP) break;
+
+				if (z->lengths[256] == 0)
+					BAD("no end-of-block code");
+				if (!huffman_build(&z->lencode, z->lengths, z->nlen) ||
+				    !huffman_build(&z->distcode, z->lengths + z->nlen, z->ndist))
+					BAD("bad literal/length or distance code");
+				z->mode = M_LEN;
+				break;
+
+			case M_CODEREP:
+			{
+				int rep, extra, value = 0;
+
+				extra = (z->sym == 16) ? 2 : (z->sym == 17) ? 3 : 7;
+				NEEDBITS(extra);
+				rep = BITS(extra) + ((z->sym == 18) ? 11 : 3);
+				DROPBITS(extra);
+				if (z->sym == 16)
+					value = z->lengths[z->index - 1];
+				if (z->index + rep > z->nlen + z->ndist)
+					BAD("too many code lengths");
+				while (rep-- > 0)
+					z->lengths[z->index++] = value;
+				z->mode = M_CODELENS;
+				break;
+			}
+
+			case M_LEN:
+				sym = huffman_decode(z, &z->lencode);
+				if (sym == -1)
+				{
+					PULLBYTE();
+					break;
+				}
+				if (sym < 0)
+					BAD("bad literal/length code");
+				if (sym < 256)
+				{
+					z->window[z->wpos] = (unsigned char)sym;
+					ADVANCE();
+				}
+				else if (sym == 256)
+					z->mode = z->last ? M_CHECK : M_BLOCK;
+				else
+				{
+					z->sym = sym - 257;
+					if (z->sym >= 29)
+						BAD("bad length code");
+					z->mode = M_LENEXT;
+				}
+				break;
+
+			case M_LENEXT:
+				NEEDBITS(len_extra[z->sym]);
+				z->length = len_base[z->sym] + BITS(len_extra[z->sym]);
+				DROPBITS(len_extra[z->sym]);
+				z->mode = M_DIST;
+				break;
+
+			case M_DIST:
+				sym = huffman_decode(z, &z->distcode);
+				if (sym == -1)
+				{
+					PULLBYTE();
+					break;
+				}
+				if (sym < 0 || sym >= 30)
+					BAD("bad distance code");
+				z->sym = sym;
+				z->mode = M_DISTEXT;
+				break;
+
+			case M_DISTEXT:
+			{
+				unsigned long from;
+
+				NEEDBITS(dist_extra[z->sym]);
+				z->dist = dist_base[z->sym] + BITS(dist_extra[z->sym]);
+				DROPBITS(dist_extra[z->sym]);
+				if ((unsigned long)z->dist > z->whave)
+					BAD("distance too far back");
+
+				/* the match never needs input, so copy it all now */
+				from = (z->wpos - z->dist) & (z->wsize - 1);
+				while (z->length-- > 0)
+				{
+					z->window[z->wpos] = z->window[from];
+					from = (from + 1) & (z->wsize - 1);
+					ADVANCE();
+				}
+				z->mode = M_LEN;
+				break;
+			}
+
+			case M_CHECK:
+				DROPBITS(z->bitcnt & 7);
+				if (z->format == INFLATE_RAW)
+				{
+					z->mode = M_DONE;
+					break;
+				}
+				if (z->format == INFLATE_GZIP)
+				{
+					/* crc32 then length, both little-endian */
+					while (z->check_n < 8)
+					{
+						NEEDBITS(8);
+						if (z->check_n < 4)
+							z->check |= (unsigned long)BITS(8) << (8 * z->check_n);
+						else
+							z->isize |= (unsigned long)BITS(8) << (8 * (z->check_n - 4));
+						DROPBITS(8);
+						z->check_n++;
+					}
+					inflate_flush(z, session_idx, next);
+					if (z->check != ((z->crc ^ 0xFFFFFFFFUL) & 0xFFFFFFFFUL))
+						BAD("checksum mismatch");
+					if (z->isize != (z->total & 0xFFFFFFFFUL))
+						BAD("length mismatch");
+					z->mode = M_DONE;
+					break;
+				}
+				while (z->check_n < 4)
+				{
+					NEEDBITS(8);
+					z->check = (z->check << 8) | (unsigned long)BITS(8);
+					DROPBITS(8);
+					z->check_n++;
+				}
+				inflate_flush(z, session_idx, next);
+				if (z->check != z->adler)
+					BAD("checksum mismatch");
+				z->mode = M_DONE;
+				break;
+		}
+	}
+
+out:
+	inflate_flush(z, session_idx, next);
+
+	/* bytes pulled into bitbuf but never used are given back */
+	*used = (size_t)(in - (const unsigned char*)buf);
+	if (z->mode == M_DONE)
+	{
+		size_t back = (size_t)(z->bitcnt >> 3);
+
+		if (back > *used) back = *used;
+		*used -= back;
+		z->bitbuf = 0;
+		z->bitcnt = 0;
+		return INFLATE_END;
+	}
+
+	return (z->mode == M_BAD) ? INFLATE_ERROR : INFLATE_MORE;
+}
@@ -0,0 +1,32 @@
+/*
+ * SevenTTY - streaming inflate
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "filter.h"
+
+/* stream formats for inflate_new() */
+#define INFLATE_ZLIB  0   /* zlib header and adler32 trailer (RFC 1950) */
+#define INFLATE_RAW   1   /* bare deflate blocks (RFC 1951) */
+#define INFLATE_GZIP  2   /* gzip member, crc32 and length checked (RFC 1952) */
+
+/* inflate_feed() results */
+#define INFLATE_MORE   0  /* input used up, the stream goes on */
+#define INFLATE_END    1  /* stream finished, *used says where */
+#define INFLATE_ERROR -1  /* corrupt stream or no memory */
+
+struct inflater;
+
+struct inflater* inflate_new(int format);
+void inflate_free(struct inflater* z);
+
+/* Decode a piece of the stream, passing the output to next. Pieces may
+   split the stream anywhere. On INFLATE_END, bytes past *used are not
+   part of the stream. */
+int inflate_feed(struct inflater* z, int session_idx, const char* in, size_t len,
+                 size_t* used, const struct filter_stage* next);
+
+const char* inflate_error(const struct inflater* z);
@@ -0,0 +1,11 @@
+/*
+ * SevenTTY - private key file formats
+ */
+
+#pragma once
+
+/* Does a private key (NUL terminated file contents) need its passphrase?
+   0 for a plain PEM key or an OpenSSH key with cipher "none", 1 for an
+   encrypted one, and 1 for anything not recognised, so that libssh2
+   still gets the passphrase. */
+int key_encrypted(const char* priv);
@@ -7,180 +7,576 @@
 
 #include "app.h"
 #include "net.h"
+#include "bench.h"
 #include "console.h"
 #include "debug.h"
+#include "filter.h"
+#include "keyfile.h"
+#include "telnet.h"
 
 #include <errno.h>
 #include <stdio.h>
 #include <Script.h>
 #include <Threads.h>
+#include <Windows.h>
 
 #include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/platform_util.h>
+
+/* ------------------------------------------------------------------ */
+/* outbound queue                                                     */
+/* ------------------------------------------------------------------ */
+
+/* Keystrokes, pastes and vterm replies for SSH, telnet and nc sessions
+   are queued per session and written by that session's own thread.
+   Bytes arriving within prefs.send_coalesce ticks of the first queued
+   byte leave in one channel write / OTSnd, so a burst of typing costs
+   one SSH packet instead of one each. When the connection pushes back
+   (EAGAIN, kOTFlowErr) the bytes stay queued until the thread is woken
+   by the network again, and a full queue makes the producer wait. */
+
+static void session_paste_feed(int session_idx);
+
+/* one non-blocking channel write: bytes taken, 0 if it would block, -1 on error */
+static int ssh_send_some(int session_idx, const char* buf, size_t len)
+{
+	struct session* s = &sessions[session_idx];
+	ssize_t r;
+
+	if (s->channel == NULL) return 0;
+
+	ssh_conn_begin(session_idx);
+	r = libssh2_channel_write(s->channel, buf, len);
+	ssh_conn_end(session_idx, (int)r);
+
+	if (r == LIBSSH2_ERROR_EAGAIN) return 0;
+
+	if (r < 1)
+	{
+		printf_s(session_idx, "Failed to write to channel, closing connection.\r\n");
+		s->thread_command = EXIT;
+		return -1;
+	}
+
+	ssh_conn_count(session_idx, 0, r);
+	return (int)r;
+}
 
-void ssh_write_s(int session_idx, char* buf, size_t len)
+/* Session thread: write out the queue once the latency window is over,
+   or right away when force is set or the queue is filling up. Returns 1
+   while bytes are still waiting; out_blocked tells whether that's the
+   window (come back soon) or the connection (wait for the network). */
+int session_flush_output(int session_idx, int force)
 {
 	struct session* s = &sessions[session_idx];
 
-	while (len > 0 && s->thread_state == OPEN && s->thread_command != EXIT)
+	if (s->paste_data != NULL) session_paste_feed(session_idx);
+	if (s->out_len == 0) return s->paste_data != NULL;
+
+	if (!force && s->out_len < OUT_QUEUE_SIZE / 2 &&
+	    (long)(TickCount() - s->out_since) < prefs.send_coalesce)
+		return 1;
+
+	while (s->out_len > 0)
 	{
-		int r = libssh2_channel_write(s->channel, buf, len);
+		int r;
 
-		if (r == LIBSSH2_ERROR_EAGAIN)
+		if (s->thread_state != OPEN || s->thread_command == EXIT)
 		{
-			YieldToAnyThread();
-			continue;
+			s->out_len = 0;
+			break;
 		}
 
-		if (r < 1)
+		if (s->type == SESSION_SSH)
+			r = ssh_send_some(session_idx, s->out_queue, s->out_len);
+		else
+			r = tcp_send_some(session_idx, s->out_queue, s->out_len);
+
+		if (r < 0)
 		{
-			printf_s(session_idx, "Failed to write to channel, closing connection.\r\n");
-			s->thread_command = EXIT;
-			return;
+			s->out_len = 0;
+			break;
 		}
 
-		buf += r;
-		len -= r;
+		if (r == 0)
+		{
+			s->out_blocked = 1;
+			return 1;
+		}
+
+		s->out_len -= r;
+		memmove(s->out_queue, s->out_queue + r, s->out_len);
 	}
+
+	s->out_blocked = 0;
+	return s->paste_data != NULL;
 }
 
-void ssh_write(char* buf, size_t len)
+/* queue bytes for the session's connection */
+void session_send(int session_idx, const char* buf, size_t len)
 {
-	ssh_write_s(active_session_global(), buf, len);
+	struct session* s = &sessions[session_idx];
+	ThreadID current = kNoThreadID;
+	int own_thread;
+
+	MacGetCurrentThread(&current);
+	own_thread = (current == s->thread_id);
+
+	while (len > 0 && s->thread_state == OPEN && s->thread_command != EXIT)
+	{
+		size_t room = OUT_QUEUE_SIZE - s->out_len;
+
+		if (room == 0)
+		{
+			/* backpressure: the session thread drains it, or if this is
+			   the session thread (vterm replies) it does so here */
+			if (own_thread)
+			{
+				if (session_flush_output(session_idx, 1) && s->out_len == OUT_QUEUE_SIZE)
+					tcp_wait_readable(session_idx);
+			}
+			else if (s->type == SESSION_SSH && s->channel == NULL)
+			{
+				break;  /* still logging in, nobody drains it yet */
+			}
+			else
+			{
+				tcp_wake(session_idx);
+				YieldToAnyThread();
+			}
+			continue;
+		}
+
+		if (room > len) room = len;
+		if (s->out_len == 0) s->out_since = TickCount();
+		memcpy(s->out_queue + s->out_len, buf, room);
+		s->out_len += room;
+		buf += room;
+		len -= room;
+	}
+
+	if (s->out_len > 0 && !own_thread)
+		tcp_wake(session_idx);
 }
 
-/* Translate ANSI.SYS sequences to DEC VT equivalents.
-   ESC[s -> ESC 7 (save cursor), ESC[u -> ESC 8 (restore cursor).
-   Uses per-session state to handle sequences split across chunks.
-   Reads from in, writes to out. Returns output length. */
-static int ansi_sys_fixup(int session_idx, const char* in, int len,
-                          char* out)
+/* queued bytes or a paste that only wait on the clock, not the network */
+int session_has_output(int session_idx)
 {
 	struct session* s = &sessions[session_idx];
-	int ri = 0, wi = 0;
 
-	while (ri < len)
+	return (s->out_len > 0 || s->paste_data != NULL) && !s->out_blocked;
+}
+
+/* anything waiting on the clock? (event loop sleep) */
+int session_output_pending(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+		if (session_has_output(i))
+			return 1;
+
+	return 0;
+}
+
+/* session thread on its way out: drop whatever never got sent */
+void session_output_discard(int session_idx)
+{
+	session_paste_cancel(session_idx);
+	sessions[session_idx].out_len = 0;
+	sessions[session_idx].out_blocked = 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* streaming paste                                                    */
+/* ------------------------------------------------------------------ */
+
+/* A paste is kept in its scrap handle and fed into the outbound queue
+   by the session thread as room frees up, so a large clipboard never
+   stalls the event loop. Telnet gets CR LF line ends and, with
+   prefs.paste_pace, a pause after each line for hosts that drop input
+   arriving faster than they read it. With prefs.paste_bracket the paste
+   is wrapped in bracketed-paste markers when the remote asked for them
+   (libvterm only emits them in mode 2004). Big pastes show progress in
+   the window title, and the title it covered comes back at the end;
+   Cmd-. cancels. */
+
+#define PASTE_PROGRESS_MIN 8192
+#define PASTE_PROGRESS_TICKS 30
+
+static void paste_title(int session_idx, const char* title)
+{
+	struct session* s = &sessions[session_idx];
+	struct window_context* wc = window_for_session(session_idx);
+
+	if (wc == NULL || session_idx != wc->session_ids[wc->active_session_idx])
+		return;
+
+	/* keep the whole title, not the tab label's first 63 characters */
+	if (!s->paste_titled)
 	{
-		char c = in[ri];
+		Str255 old;
 
-		switch (s->ansi_fixup_state)
-		{
-			case 0:
-				if (c == '\033')
-					s->ansi_fixup_state = 1;
-				else
-					out[wi++] = c;
-				ri++;
-				break;
+		GetWTitle(wc->win, old);
+		memcpy(s->paste_title, old + 1, old[0]);
+		s->paste_title[old[0]] = '\0';
+		s->paste_titled = 1;
+	}
 
-			case 1:
-				if (c == '[')
-				{
-					s->ansi_fixup_state = 2;
-					ri++;
-				}
-				else
-				{
-					out[wi++] = '\033';
-					s->ansi_fixup_state = 0;
-				}
-				break;
+	set_window_title(wc->win, title, strlen(title));
+}
 
-			case 2:
-				if (c == 's')
-				{
-					out[wi++] = '\033';
-					out[wi++] = '7';
-				}
-				else if (c == 'u')
-				{
-					out[wi++] = '\033';
-					out[wi++] = '8';
-				}
-				else
-				{
-					out[wi++] = '\033';
-					out[wi++] = '[';
-					out[wi++] = c;
-				}
-				s->ansi_fixup_state = 0;
-				ri++;
-				break;
-		}
+/* put back what the progress covered, or what the host set since */
+static void paste_title_restore(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	struct window_context* wc = window_for_session(session_idx);
+
+	if (!s->paste_titled) return;
+	s->paste_titled = 0;
+
+	if (wc != NULL && session_idx == wc->session_ids[wc->active_session_idx])
+		set_window_title(wc->win, s->paste_title, strlen(s->paste_title));
+}
+
+static void paste_progress(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	char title[80];
+
+	if (s->paste_len < PASTE_PROGRESS_MIN) return;
+	if ((long)(TickCount() - s->paste_shown) < PASTE_PROGRESS_TICKS) return;
+
+	s->paste_shown = TickCount();
+	snprintf(title, sizeof(title), "Pasting %ldK of %ldK (Cmd-. cancels)",
+		s->paste_pos / 1024, (s->paste_len + 1023) / 1024);
+	paste_title(session_idx, title);
+}
+
+/* take over a scrap handle holding len bytes; 0 if it can't start */
+int session_paste_start(int session_idx, Handle data, long len)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->paste_data != NULL || s->thread_state != OPEN || len <= 0)
+		return 0;
+
+	HLock(data);
+	s->paste_data = data;
+	s->paste_pos = 0;
+	s->paste_len = len;
+	s->paste_resume = 0;
+	s->paste_shown = TickCount();
+	s->paste_bracketed = 0;
+
+	if (prefs.paste_bracket && s->vterm != NULL)
+	{
+		vterm_keyboard_start_paste(s->vterm);
+		s->paste_bracketed = 1;
 	}
 
-	return wi;
+	tcp_wake(session_idx);
+	return 1;
 }
 
-// read from the channel and print to console
-void ssh_read(int session_idx)
+/* stop a paste (Cmd-., disconnect) or finish one */
+void session_paste_cancel(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->paste_data == NULL) return;
+
+	/* cleared first: end_paste comes back through session_send */
+	DisposeHandle(s->paste_data);
+	s->paste_data = NULL;
+	s->paste_pos = s->paste_len = 0;
+
+	if (s->paste_bracketed && s->vterm != NULL)
+		vterm_keyboard_end_paste(s->vterm);
+	s->paste_bracketed = 0;
+
+	paste_title_restore(session_idx);
+}
+
+/* session thread: move the next part of the paste into the queue */
+static void session_paste_feed(int session_idx)
 {
 	struct session* s = &sessions[session_idx];
-	ssize_t rc = libssh2_channel_read(s->channel, s->recv_buffer, SSH_BUFFER_SIZE);
+	int telnet = (s->type == SESSION_TELNET);
 
-	if (rc == 0) return;
+	if (s->paste_resume != 0)
+	{
+		if ((long)(TickCount() - s->paste_resume) < 0) return;
+		s->paste_resume = 0;
+	}
 
-	if (rc <= 0)
+	while (s->paste_pos < s->paste_len)
 	{
-		/* only report the error if we weren't told to shut down */
-		if (s->thread_command != EXIT)
+		const char* p = *s->paste_data + s->paste_pos;
+		size_t room = OUT_QUEUE_SIZE - s->out_len;
+		size_t n = s->paste_len - s->paste_pos;
+		const char* cr = NULL;
+
+		/* keep a byte spare for the LF after a telnet CR */
+		if (room < 2) break;
+		if (n > room - 1) n = room - 1;
+
+		if (telnet && (cr = memchr(p, '\r', n)) != NULL)
+			n = cr - p + 1;
+
+		session_send(session_idx, p, n);
+		s->paste_pos += n;
+
+		if (cr != NULL)
 		{
-			printf_s(session_idx, "channel read error: %s\r\n", libssh2_error_string(rc));
-			s->thread_command = EXIT;
+			session_send(session_idx, "\n", 1);
+			if (prefs.paste_pace > 0)
+			{
+				s->paste_resume = TickCount() + prefs.paste_pace;
+				break;
+			}
 		}
 	}
 
-	if (rc > 0)
+	if (s->paste_pos >= s->paste_len)
+		session_paste_cancel(session_idx);
+	else
+		paste_progress(session_idx);
+}
+
+/* ------------------------------------------------------------------ */
+/* shared SSH connections                                             */
+/* ------------------------------------------------------------------ */
+
+/* One authenticated LIBSSH2_SESSION can carry channels for several tabs
+   and scp workers to the same user@host:port. Each user holds a
+   reference; the TCP endpoint and session go away with the last one.
+   Sessions mirror the shared handles in s->ssh_session / s->endpoint. */
+struct ssh_conn {
+	int in_use;
+	int refcount;
+	int usable;               /* authenticated and not known to be dead */
+	LIBSSH2_SESSION* session;
+	EndpointRef endpoint;
+	ThreadID send_owner;      /* thread with a half-sent packet, or none */
+	char key[300];            /* "user@host:port" */
+	int profile;              /* algorithm profile and zlib offer it was */
+	int compress;             /* set up with, which a sharer must match */
+	struct ssh_algos algos;   /* what the handshake settled on */
+	struct ssh_traffic traffic;
+};
+
+static struct ssh_conn ssh_conns[MAX_SESSIONS];
+
+static int ssh_conn_alloc(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
 	{
-		char fixup[SSH_BUFFER_SIZE];
-		int fixup_len = ansi_sys_fixup(session_idx, s->recv_buffer, rc,
-		                               fixup);
-		rc = fixup_len;
-		if (rc > 0)
-			memcpy(s->recv_buffer, fixup, rc);
+		struct ssh_conn* c = &ssh_conns[i];
+		if (c->in_use) continue;
+
+		c->in_use = 1;
+		c->refcount = 1;
+		c->usable = 0;
+		c->session = NULL;
+		c->endpoint = kOTInvalidEndpointRef;
+		c->send_owner = kNoThreadID;
+		c->key[0] = '\0';
+		memset(&c->algos, 0, sizeof(c->algos));
+		memset(&c->traffic, 0, sizeof(c->traffic));
+		s->ssh_conn = i;
+		return i;
 	}
 
-	while (rc > 0 && s->vterm != NULL)
+	return -1;
+}
+
+/* attach a session to an existing connection for user@host:port that
+   was negotiated with the same profile and compression offer */
+static int ssh_conn_attach(int session_idx, const char* key, int profile, int compress)
+{
+	struct session* s = &sessions[session_idx];
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
 	{
-		size_t written = vterm_input_write(s->vterm, s->recv_buffer, rc);
-		if (written == 0) break;
-		rc -= written;
+		struct ssh_conn* c = &ssh_conns[i];
+		if (!c->in_use || !c->usable) continue;
+		if (strcmp(c->key, key) != 0) continue;
+		if (c->profile != profile || c->compress != compress) continue;
+
+		c->refcount++;
+		s->ssh_conn = i;
+		s->ssh_session = c->session;
+		s->endpoint = c->endpoint;
+		s->ssh_algos = c->algos;
+		return 1;
 	}
+
+	return 0;
 }
 
-void end_connection(int session_idx)
+/* index of the session whose thread is running right now on connection
+   ci, or -1 (e.g. the main event loop writing keystrokes) */
+static int ssh_conn_current_session(int ci)
 {
-	struct session* s = &sessions[session_idx];
-	s->thread_state = CLEANUP;
+	ThreadID current = kNoThreadID;
+	int i;
 
-	OSStatus err = noErr;
+	if (MacGetCurrentThread(&current) != noErr) return -1;
 
-	if (s->ssh_session)
+	for (i = 0; i < MAX_SESSIONS; i++)
 	{
-		/* switch to non-blocking so cleanup calls don't hang */
-		libssh2_session_set_blocking(s->ssh_session, 0);
+		if (sessions[i].in_use && sessions[i].ssh_conn == ci &&
+		    sessions[i].thread_id == current)
+			return i;
 	}
 
-	if (s->channel)
+	return -1;
+}
+
+/* Whoever pulls bytes off the wire demultiplexes them into libssh2's
+   per-channel queues; flag everybody else on the connection so their
+   readers look at their own channel. Interrupt-safe. */
+static void ssh_conn_kick(int ci, int except_idx)
+{
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
 	{
-		libssh2_channel_send_eof(s->channel);
-		libssh2_channel_close(s->channel);
-		libssh2_channel_free(s->channel);
-		s->channel = NULL;
+		if (i != except_idx && sessions[i].in_use && sessions[i].ssh_conn == ci)
+			tcp_signal(i);
 	}
+}
+
+/* OT notifier for shared SSH endpoints, context = connection index + 1 */
+static pascal void ssh_conn_notifier(void* context, OTEventCode event,
+                                     OTResult result, void* cookie)
+{
+	int ci = (int)(intptr_t)context - 1;
+
+	(void)result;
+	(void)cookie;
 
-	if (s->ssh_session)
+	switch (event)
 	{
-		libssh2_session_disconnect(s->ssh_session, "Normal Shutdown, Thank you for playing");
-		libssh2_session_free(s->ssh_session);
-		s->ssh_session = NULL;
+		case T_DATA:
+		case T_EXDATA:
+		case T_CONNECT:
+		case T_DISCONNECT:
+		case T_RESET:
+		case T_ORDREL:
+		case T_GODATA:
+		case T_GOEXDATA:
+		case kOTProviderWillClose:
+		case kOTProviderIsClosed:
+			if (ci >= 0 && ci < MAX_SESSIONS)
+				ssh_conn_kick(ci, -1);
+			break;
+		default:
+			break;
+	}
+}
+
+/* libssh2 keeps one partially sent packet per session and answers any
+   other call that wants to send with LIBSSH2_ERROR_BAD_USE until the
+   call that left it there is repeated. Threads sharing a connection
+   bracket their libssh2 calls with these: begin waits while another
+   thread owns such a packet, end takes or drops ownership. */
+void ssh_conn_begin(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	struct ssh_conn* c;
+	ThreadID current = kNoThreadID;
+
+	if (s->ssh_conn < 0) return;
+	c = &ssh_conns[s->ssh_conn];
+	MacGetCurrentThread(&current);
+
+	while (c->send_owner != kNoThreadID && c->send_owner != current &&
+	       c->usable && s->thread_command != EXIT)
+		YieldToAnyThread();
+}
+
+void ssh_conn_end(int session_idx, int rc)
+{
+	struct session* s = &sessions[session_idx];
+	struct ssh_conn* c;
+	ThreadID current = kNoThreadID;
+
+	if (s->ssh_conn < 0) return;
+	c = &ssh_conns[s->ssh_conn];
+	MacGetCurrentThread(&current);
+
+	if (rc == LIBSSH2_ERROR_EAGAIN && c->session != NULL &&
+	    (libssh2_session_block_directions(c->session) & LIBSSH2_SESSION_BLOCK_OUTBOUND))
+		c->send_owner = current;
+	else if (c->send_owner == current)
+		c->send_owner = kNoThreadID;
+}
+
+/* after a call bracketed by begin/end said EAGAIN: a send held up by
+   flow control only needs a yield, but waiting on the server sleeps
+   until the connection has news, as read_thread does */
+void ssh_conn_wait(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	struct ssh_conn* c;
+
+	if (s->ssh_conn < 0)
+	{
+		YieldToAnyThread();
+		return;
 	}
+	c = &ssh_conns[s->ssh_conn];
+
+	if (c->session != NULL &&
+	    (libssh2_session_block_directions(c->session) & LIBSSH2_SESSION_BLOCK_OUTBOUND))
+		YieldToAnyThread();
+	else
+		tcp_wait_readable(session_idx);
+}
+
+/* drop this session's reference; tear the connection down with the last */
+static void ssh_conn_release(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	struct ssh_conn* c;
+	OSStatus err = noErr;
+
+	if (s->ssh_conn < 0) return;
 
-	libssh2_exit();
+	ssh_conn_end(session_idx, LIBSSH2_ERROR_NONE);
+	c = &ssh_conns[s->ssh_conn];
+	s->ssh_conn = -1;
+	s->ssh_session = NULL;
+	s->endpoint = kOTInvalidEndpointRef;
+	memset(&s->ssh_algos, 0, sizeof(s->ssh_algos));
 
-	if (s->endpoint != kOTInvalidEndpointRef)
+	if (--c->refcount > 0) return;
+
+	c->usable = 0;
+
+	if (c->session)
+	{
+		libssh2_session_set_blocking(c->session, 0);
+		libssh2_session_disconnect(c->session, "Normal Shutdown, Thank you for playing");
+		libssh2_session_free(c->session);
+		c->session = NULL;
+		libssh2_exit();
+	}
+
+	if (c->endpoint != kOTInvalidEndpointRef)
 	{
 		// request to close the TCP connection
-		OTSndOrderlyDisconnect(s->endpoint);
+		OTSndOrderlyDisconnect(c->endpoint);
 
 		// discard remaining data so we can finish closing the connection
 		// limit iterations to prevent infinite loop if endpoint is stuck
@@ -188,27 +584,28 @@ void end_connection(int session_idx)
 			int rc = 1;
 			int drain_count = 0;
 			OTFlags ot_flags;
+			char discard;
 			while (rc != kOTLookErr && drain_count < 1000)
 			{
-				rc = OTRcv(s->endpoint, s->recv_buffer, 1, &ot_flags);
+				rc = OTRcv(c->endpoint, &discard, 1, &ot_flags);
 				drain_count++;
 			}
 		}
 
 		// finish closing the TCP connection
-		OSStatus result = OTLook(s->endpoint);
+		OSStatus result = OTLook(c->endpoint);
 
 		switch (result)
 		{
 			case T_DISCONNECT:
-				OTRcvDisconnect(s->endpoint, nil);
+				OTRcvDisconnect(c->endpoint, nil);
 				break;
 
 			case T_ORDREL:
-				err = OTRcvOrderlyDisconnect(s->endpoint);
+				err = OTRcvOrderlyDisconnect(c->endpoint);
 				if (err == noErr)
 				{
-					err = OTSndOrderlyDisconnect(s->endpoint);
+					err = OTSndOrderlyDisconnect(c->endpoint);
 				}
 				break;
 
@@ -217,11 +614,646 @@ void end_connection(int session_idx)
 		}
 
 		// release endpoint
-		OTUnbind(s->endpoint);
-		OTCloseProvider(s->endpoint);
-		s->endpoint = kOTInvalidEndpointRef;
+		OTUnbind(c->endpoint);
+		OTCloseProvider(c->endpoint);
+		c->endpoint = kOTInvalidEndpointRef;
+	}
+
+	c->in_use = 0;
+}
+
+/* "user@host:port" of the connection a session uses, and how many
+   tabs/workers share it; NULL if the session has no connection */
+const char* ssh_conn_info(int session_idx, int* users)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->ssh_conn < 0) return NULL;
+	if (users) *users = ssh_conns[s->ssh_conn].refcount;
+	return ssh_conns[s->ssh_conn].key;
+}
+
+/* channel payload moved by a session, next to the wire bytes counted in
+   the send/recv callbacks; the two differ by packet overhead and zlib */
+void ssh_conn_count(int session_idx, long in, long out)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->ssh_conn < 0) return;
+	ssh_conns[s->ssh_conn].traffic.data_in += in;
+	ssh_conns[s->ssh_conn].traffic.data_out += out;
+}
+
+int ssh_conn_traffic(int session_idx, struct ssh_traffic* t)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->ssh_conn < 0) return 0;
+	*t = ssh_conns[s->ssh_conn].traffic;
+	return 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* connection phase timing                                            */
+/* ------------------------------------------------------------------ */
+
+/* The last CONN_TIMING_RECORDS connection attempts of any kind (ssh,
+   scp, telnet, nc, wget, ftp), newest last. Each session owns at most
+   one open record, found by sequence number so a slot that was reused
+   in the meantime is left alone. */
+static struct conn_timing conn_timings[CONN_TIMING_RECORDS];
+static unsigned long conn_timing_seq = 0;
+
+static struct conn_timing* conn_timing_current(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	struct conn_timing* r;
+
+	if (s->conn_timing == 0) return NULL;
+	r = &conn_timings[s->conn_timing % CONN_TIMING_RECORDS];
+	if (r->seq != s->conn_timing || r->result != CONN_PENDING) return NULL;
+	return r;
+}
+
+void conn_timing_begin(int session_idx, const char* kind, const char* target)
+{
+	struct conn_timing* r;
+	int i;
+
+	conn_timing_end(session_idx, 0);
+
+	r = &conn_timings[++conn_timing_seq % CONN_TIMING_RECORDS];
+	r->seq = conn_timing_seq;
+	snprintf(r->kind, sizeof(r->kind), "%s", kind);
+	snprintf(r->target, sizeof(r->target), "%s", target);
+	for (i = 0; i < PHASE_COUNT; i++) r->ticks[i] = -1;
+	r->start = r->last = TickCount();
+	r->total = 0;
+	r->result = CONN_PENDING;
+
+	sessions[session_idx].conn_timing = conn_timing_seq;
+}
+
+/* the phase that just finished took the time since the previous mark */
+void conn_timing_mark(int session_idx, enum CONN_PHASE phase)
+{
+	struct conn_timing* r = conn_timing_current(session_idx);
+	long now = TickCount();
+
+	if (r == NULL) return;
+	r->ticks[phase] = now - r->last;
+	r->last = now;
+}
+
+void conn_timing_end(int session_idx, int ok)
+{
+	struct conn_timing* r = conn_timing_current(session_idx);
+
+	sessions[session_idx].conn_timing = 0;
+	if (r == NULL) return;
+	r->total = TickCount() - r->start;
+	r->result = ok ? CONN_OK : CONN_FAILED;
+}
+
+/* i-th most recent record (0 = newest), or NULL */
+const struct conn_timing* conn_timing_get(int i)
+{
+	const struct conn_timing* r;
+
+	if (i < 0 || i >= CONN_TIMING_RECORDS || (unsigned long)i >= conn_timing_seq)
+		return NULL;
+	r = &conn_timings[(conn_timing_seq - i) % CONN_TIMING_RECORDS];
+	return r->seq != 0 ? r : NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* DNS cache                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Name -> address cache shared by every connect path and "host". OT
+   does not hand out record TTLs, so entries live for DNS_CACHE_TTL;
+   a failed connect to a cached address drops it early. */
+#define DNS_CACHE_SIZE    16
+#define DNS_CACHE_TTL     (10L * 60 * 60)  /* 10 minutes in ticks */
+#define DNS_TIMEOUT_TICKS 600              /* 10 seconds */
+
+struct dns_entry {
+	char name[256];          /* "" = free */
+	InetHost addr;
+	long expires;
+	long last_used;
+};
+
+static struct dns_entry dns_cache[DNS_CACHE_SIZE];
+
+/* state for the idle notifier of one lookup */
+struct dns_wait {
+	InetSvcRef svc;
+	long deadline;
+	int session_idx;
+};
+
+static pascal void dns_notifier(void* context, OTEventCode event,
+                                OTResult result, void* cookie)
+{
+	struct dns_wait* w = (struct dns_wait*)context;
+
+	(void)result;
+	(void)cookie;
+
+	if (event != kOTSyncIdleEvent) return;
+
+	YieldToAnyThread();
+	if (TickCount() > w->deadline ||
+	    (w->session_idx >= 0 && sessions[w->session_idx].thread_command == EXIT))
+		OTCancelSynchronousCalls(w->svc, kOTCanceledErr);
+}
+
+static struct dns_entry* dns_cache_find(const char* name)
+{
+	int i;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		struct dns_entry* e = &dns_cache[i];
+		if (e->name[0] == '\0') continue;
+		if ((long)(TickCount() - e->expires) >= 0)
+		{
+			e->name[0] = '\0';
+			continue;
+		}
+		if (strcmp(e->name, name) == 0) return e;
+	}
+
+	return NULL;
+}
+
+void dns_cache_store(const char* name, InetHost addr)
+{
+	struct dns_entry* e = dns_cache_find(name);
+	int i;
+
+	if (strlen(name) >= sizeof(e->name)) return;
+
+	/* reuse a free slot, else the least recently used one */
+	if (e == NULL)
+	{
+		e = &dns_cache[0];
+		for (i = 0; i < DNS_CACHE_SIZE; i++)
+		{
+			if (dns_cache[i].name[0] == '\0') { e = &dns_cache[i]; break; }
+			if (dns_cache[i].last_used < e->last_used) e = &dns_cache[i];
+		}
+		strcpy(e->name, name);
+	}
+
+	e->addr = addr;
+	e->expires = TickCount() + DNS_CACHE_TTL;
+	e->last_used = TickCount();
+}
+
+void dns_cache_forget(const char* name)
+{
+	struct dns_entry* e = dns_cache_find(name);
+	if (e) e->name[0] = '\0';
+}
+
+int dns_cache_flush(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		if (dns_cache[i].name[0] != '\0') n++;
+		dns_cache[i].name[0] = '\0';
+	}
+
+	return n;
+}
+
+/* i-th live cache entry for listing; returns 0 past the end */
+int dns_cache_entry(int i, const char** name, InetHost* addr, long* ttl_ticks)
+{
+	int k;
+
+	for (k = 0; k < DNS_CACHE_SIZE; k++)
+	{
+		struct dns_entry* e = &dns_cache[k];
+		if (e->name[0] == '\0' || (long)(TickCount() - e->expires) >= 0) continue;
+		if (i-- > 0) continue;
+		*name = e->name;
+		*addr = e->addr;
+		*ttl_ticks = (long)(e->expires - TickCount());
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Full lookup through OT, every address filled into info. Yields while
+   waiting; gives up after 10 seconds or when session_idx (if >= 0) is
+   told to exit. Successful lookups go into the cache. */
+OSStatus dns_lookup(int session_idx, const char* name, InetHostInfo* info)
+{
+	struct dns_wait w;
+	OSStatus err = noErr;
+
+	w.svc = OTOpenInternetServices(kDefaultInternetServicesPath, 0, &err);
+	if (err != noErr || w.svc == NULL)
+		return err != noErr ? err : kOTBadNameErr;
+
+	w.deadline = TickCount() + DNS_TIMEOUT_TICKS;
+	w.session_idx = session_idx;
+
+	OTSetSynchronous(w.svc);
+	OTSetBlocking(w.svc);
+	OTInstallNotifier(w.svc, dns_notifier, &w);
+	OTUseSyncIdleEvents(w.svc, true);
+
+	err = OTInetStringToAddress(w.svc, (char*)name, info);
+	OTCloseProvider(w.svc);
+
+	if (err == noErr && info->addrs[0] != 0)
+		dns_cache_store(name, info->addrs[0]);
+	else if (err == noErr)
+		err = kOTBadNameErr;
+
+	return err;
+}
+
+/* resolve a name, dotted quad or cache hit first */
+OSStatus dns_resolve(int session_idx, const char* name, InetHost* out)
+{
+	struct dns_entry* e;
+	InetHostInfo info;
+	OSStatus err;
+
+	if (OTInetStringToHost((char*)name, out) == noErr)
+		return noErr;
+
+	e = dns_cache_find(name);
+	if (e)
+	{
+		e->last_used = TickCount();
+		*out = e->addr;
+		return noErr;
+	}
+
+	err = dns_lookup(session_idx, name, &info);
+	if (err == noErr) *out = info.addrs[0];
+	return err;
+}
+
+/* split "host:port" and resolve the host into an OT address */
+OSStatus dns_resolve_hostport(int session_idx, const char* hostport,
+                              InetAddress* addr)
+{
+	char host[256];
+	const char* colon = strrchr(hostport, ':');
+	size_t hlen = colon ? (size_t)(colon - hostport) : strlen(hostport);
+	InetHost ip;
+	OSStatus err;
+
+	if (colon == NULL || hlen == 0 || hlen >= sizeof(host))
+		return kOTBadNameErr;
+
+	memcpy(host, hostport, hlen);
+	host[hlen] = '\0';
+
+	err = dns_resolve(session_idx, host, &ip);
+	if (err != noErr) return err;
+
+	OTInitInetAddress(addr, (InetPort)atoi(colon + 1), ip);
+	return noErr;
+}
+
+/* a connect to this address failed, so the cached name may be stale */
+void dns_connect_failed(const char* hostport)
+{
+	char host[256];
+	const char* colon = strrchr(hostport, ':');
+	size_t hlen = colon ? (size_t)(colon - hostport) : strlen(hostport);
+
+	if (hlen >= sizeof(host)) return;
+	memcpy(host, hostport, hlen);
+	host[hlen] = '\0';
+	dns_cache_forget(host);
+}
+
+/* ------------------------------------------------------------------ */
+/* algorithm preference profiles                                      */
+/* ------------------------------------------------------------------ */
+
+/* Offered in order before the handshake. libssh2 drops names its crypto
+   backend lacks, so each list may mention more than mbedtls can do.
+   "fast" puts the cheapest math first for 68k: ECDH instead of a 2048
+   bit modexp, RSA host keys (e=65537 verifies in a blink, ECDSA does
+   not), AES-128 and SHA-1 HMAC. "compatible" is close to the libssh2
+   defaults and keeps legacy algorithms for old servers. "strict" only
+   offers what current OpenSSH still likes. */
+struct ssh_profile
+{
+	const char* name;
+	const char* kex;
+	const char* hostkey;
+	const char* cipher;
+	const char* mac;
+};
+
+static const struct ssh_profile ssh_profiles[SSH_PROFILE_COUNT] = {
+	{
+		"fast",
+		"curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,"
+		"diffie-hellman-group14-sha256,diffie-hellman-group14-sha1,"
+		"diffie-hellman-group-exchange-sha256",
+		"rsa-sha2-256,rsa-sha2-512,ssh-rsa,ssh-ed25519,"
+		"ecdsa-sha2-nistp256,ecdsa-sha2-nistp384,ecdsa-sha2-nistp521",
+		"aes128-ctr,aes192-ctr,aes256-ctr,aes128-cbc,aes256-cbc",
+		"hmac-sha1-etm@openssh.com,hmac-sha1,"
+		"hmac-sha2-256-etm@openssh.com,hmac-sha2-256,hmac-sha2-512"
+	},
+	{
+		"compatible",
+		"curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,"
+		"ecdh-sha2-nistp384,ecdh-sha2-nistp521,"
+		"diffie-hellman-group-exchange-sha256,diffie-hellman-group16-sha512,"
+		"diffie-hellman-group18-sha512,diffie-hellman-group14-sha256,"
+		"diffie-hellman-group14-sha1,diffie-hellman-group-exchange-sha1,"
+		"diffie-hellman-group1-sha1",
+		"ssh-ed25519,ecdsa-sha2-nistp256,ecdsa-sha2-nistp384,"
+		"ecdsa-sha2-nistp521,rsa-sha2-512,rsa-sha2-256,ssh-rsa,ssh-dss",
+		"aes128-ctr,aes192-ctr,aes256-ctr,aes256-gcm@openssh.com,"
+		"aes128-gcm@openssh.com,aes256-cbc,aes192-cbc,aes128-cbc,"
+		"3des-cbc,blowfish-cbc,arcfour128,arcfour",
+		"hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com,"
+		"hmac-sha1-etm@openssh.com,hmac-sha2-256,hmac-sha2-512,hmac-sha1,"
+		"hmac-sha1-96,hmac-md5,hmac-ripemd160"
+	},
+	{
+		"strict",
+		"curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,"
+		"ecdh-sha2-nistp384,ecdh-sha2-nistp521,"
+		"diffie-hellman-group16-sha512,diffie-hellman-group18-sha512,"
+		"diffie-hellman-group14-sha256",
+		"ssh-ed25519,ecdsa-sha2-nistp256,ecdsa-sha2-nistp384,"
+		"ecdsa-sha2-nistp521,rsa-sha2-512,rsa-sha2-256",
+		"aes256-gcm@openssh.com,aes128-gcm@openssh.com,"
+		"aes256-ctr,aes192-ctr,aes128-ctr",
+		"hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com,"
+		"hmac-sha2-256,hmac-sha2-512"
+	}
+};
+
+const char* ssh_profile_name(int profile)
+{
+	if (profile < 0 || profile >= SSH_PROFILE_COUNT) return "?";
+	return ssh_profiles[profile].name;
+}
+
+/* profile index for a name, or -1 */
+int ssh_profile_lookup(const char* name)
+{
+	int i;
+
+	for (i = 0; i < SSH_PROFILE_COUNT; i++)
+		if (strcmp(ssh_profiles[i].name, name) == 0) return i;
+
+	return -1;
+}
+
+/* set the offered algorithm order; must run before the handshake */
+static void ssh_apply_profile(int session_idx, int profile)
+{
+	struct session* s = &sessions[session_idx];
+	const struct ssh_profile* p = &ssh_profiles[profile];
+	int rc;
+
+	s->ssh_algos.profile = profile;
+
+	rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_KEX, p->kex);
+	if (rc == 0)
+		rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_HOSTKEY, p->hostkey);
+	if (rc == 0)
+		rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_CRYPT_CS, p->cipher);
+	if (rc == 0)
+		rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_CRYPT_SC, p->cipher);
+	if (rc == 0)
+		rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_MAC_CS, p->mac);
+	if (rc == 0)
+		rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_MAC_SC, p->mac);
+
+	if (rc != 0)
+		printf_s(session_idx, "Algorithm profile \"%s\" not fully applied: %s\r\n",
+			p->name, libssh2_error_string(rc));
+}
+
+/* "ssh -C" / "ssh -k" settings, handed to the next SSH tab to start */
+static int next_compress = -1;
+static int next_keepalive = -1;
+
+void ssh_set_next_options(int compress, int keepalive)
+{
+	next_compress = compress;
+	next_keepalive = keepalive;
+}
+
+/* a new SSH tab takes the pending overrides, or falls back to prefs */
+void ssh_take_options(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+
+	s->ssh_compress = next_compress;
+	s->ssh_keepalive = next_keepalive;
+	next_compress = -1;
+	next_keepalive = -1;
+}
+
+static int ssh_want_compress(struct session* s)
+{
+	return s->ssh_compress >= 0 ? s->ssh_compress : prefs.ssh_compress;
+}
+
+int ssh_keepalive_secs(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	return s->ssh_keepalive >= 0 ? s->ssh_keepalive : prefs.ssh_keepalive;
+}
+
+/* offer zlib@openssh.com (after auth) ahead of plain zlib; libssh2
+   quietly drops both when it was built without zlib */
+static void ssh_offer_compression(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	int rc;
+
+	libssh2_session_flag(s->ssh_session, LIBSSH2_FLAG_COMPRESS, 1);
+	rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_COMP_CS,
+		"zlib@openssh.com,zlib,none");
+	if (rc == 0)
+		rc = libssh2_session_method_pref(s->ssh_session, LIBSSH2_METHOD_COMP_SC,
+			"zlib@openssh.com,zlib,none");
+
+	if (rc != 0)
+		printf_s(session_idx, "Compression not offered: %s\r\n", libssh2_error_string(rc));
+}
+
+/* Send a keepalive when one is due and note when the next one is, so
+   tcp_wake_sleepers gets an idle tab's thread out of its sleep in time.
+   Only called with nothing queued: libssh2 ignores EAGAIN here, and a
+   half-sent keepalive would hold up the connection for everyone. */
+static void ssh_keepalive_tick(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	int next = 0;
+	int rc;
+
+	if (s->wake_at != 0 && (long)(TickCount() - s->wake_at) < 0) return;
+
+	ssh_conn_begin(session_idx);
+	rc = libssh2_keepalive_send(s->ssh_session, &next);
+	ssh_conn_end(session_idx, rc);
+
+	if (rc != 0 || next < 1) next = 1;
+	s->wake_at = TickCount() + (unsigned long)next * 60;
+	if (s->wake_at == 0) s->wake_at = 1;
+}
+
+static void copy_method(char* dst, size_t size, LIBSSH2_SESSION* session, int type)
+{
+	const char* m = libssh2_session_methods(session, type);
+	snprintf(dst, size, "%s", m ? m : "-");
+}
+
+/* remember what the handshake picked, for sshinfo and for later tabs
+   that share the connection */
+static void ssh_record_algos(int session_idx, long ticks)
+{
+	struct session* s = &sessions[session_idx];
+	struct ssh_algos* a = &s->ssh_algos;
+
+	copy_method(a->kex, sizeof(a->kex), s->ssh_session, LIBSSH2_METHOD_KEX);
+	copy_method(a->hostkey, sizeof(a->hostkey), s->ssh_session, LIBSSH2_METHOD_HOSTKEY);
+	copy_method(a->cipher_cs, sizeof(a->cipher_cs), s->ssh_session, LIBSSH2_METHOD_CRYPT_CS);
+	copy_method(a->cipher_sc, sizeof(a->cipher_sc), s->ssh_session, LIBSSH2_METHOD_CRYPT_SC);
+	copy_method(a->mac_cs, sizeof(a->mac_cs), s->ssh_session, LIBSSH2_METHOD_MAC_CS);
+	copy_method(a->mac_sc, sizeof(a->mac_sc), s->ssh_session, LIBSSH2_METHOD_MAC_SC);
+	copy_method(a->comp, sizeof(a->comp), s->ssh_session, LIBSSH2_METHOD_COMP_CS);
+	a->handshake_ticks = ticks;
+
+	if (s->ssh_conn >= 0)
+		ssh_conns[s->ssh_conn].algos = *a;
+}
+
+/* run a non-blocking libssh2 call (X, evaluated into rc) until it stops
+   saying EAGAIN, sleeping until the connection has news in between */
+#define SSH_AGAIN(idx, X) \
+	do { \
+		sessions[idx].net_ready = 0; \
+		ssh_conn_begin(idx); \
+		rc = (X); \
+		ssh_conn_end(idx, rc); \
+		if (rc != LIBSSH2_ERROR_EAGAIN || sessions[idx].thread_command == EXIT) \
+			break; \
+		tcp_wait_readable(idx); \
+	} while (1)
+
+// read from the channel and print to console
+// returns 0 when there is nothing to read yet
+static int ssh_read(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	ssize_t rc;
+
+	/* clear before reading so news that arrives meanwhile isn't slept through */
+	s->net_ready = 0;
+	ssh_conn_begin(session_idx);
+	rc = libssh2_channel_read(s->channel, s->recv_buffer, SSH_BUFFER_SIZE);
+	ssh_conn_end(session_idx, (int)rc);
+
+	if (rc == LIBSSH2_ERROR_EAGAIN || rc == 0) return 0;
+
+	if (rc < 0)
+	{
+		/* only report the error if we weren't told to shut down */
+		if (s->thread_command != EXIT)
+		{
+			printf_s(session_idx, "channel read error: %s\r\n", libssh2_error_string(rc));
+			s->thread_command = EXIT;
+		}
+		return 1;
+	}
+
+	ssh_conn_count(session_idx, rc, 0);
+	ansi_sys_filter(session_idx, s->recv_buffer, rc, &filter_vterm);
+	if (s->predict_len > 0 || s->predict_hold) predict_check(session_idx, 1);
+	return 1;
+}
+
+/* one channel teardown call, retried on EAGAIN until the deadline */
+static int ssh_channel_step(int session_idx, LIBSSH2_CHANNEL* channel,
+                            int (*fn)(LIBSSH2_CHANNEL*), long deadline)
+{
+	int rc;
+
+	while (1)
+	{
+		ssh_conn_begin(session_idx);
+		rc = fn(channel);
+		ssh_conn_end(session_idx, rc);
+		if (rc != LIBSSH2_ERROR_EAGAIN || TickCount() >= deadline) break;
+		YieldToAnyThread();
+	}
+
+	return rc;
+}
+
+/* Close and free a channel of the session's connection. The session is
+   non-blocking (and may be shared), so each step gets a moment to get
+   through instead of the channel being abandoned. With wait_eof the far
+   end gets to finish first, e.g. a remote scp writing out its file.
+   Returns the remote command's exit status, -1 if the close never got
+   through. */
+int ssh_channel_close(int session_idx, LIBSSH2_CHANNEL* channel, int wait_eof)
+{
+	long deadline = TickCount() + (wait_eof ? 300 : 120);
+	int status = -1;
+
+	ssh_channel_step(session_idx, channel, libssh2_channel_send_eof, deadline);
+	if (wait_eof)
+		ssh_channel_step(session_idx, channel, libssh2_channel_wait_eof, deadline);
+	if (ssh_channel_step(session_idx, channel, libssh2_channel_close, deadline) == 0)
+		status = libssh2_channel_get_exit_status(channel);
+	ssh_channel_step(session_idx, channel, libssh2_channel_free, deadline);
+
+	return status;
+}
+
+/* close the session's channel but keep the connection for the next one
+   (scp sends a file per channel) */
+void ssh_channel_done(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+
+	if (s->channel)
+	{
+		ssh_channel_close(session_idx, s->channel, 1);
+		s->channel = NULL;
+	}
+}
+
+void end_connection(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	s->thread_state = CLEANUP;
+
+	if (s->channel)
+	{
+		ssh_channel_close(session_idx, s->channel, 0);
+		s->channel = NULL;
 	}
 
+	ssh_conn_release(session_idx);
+
 	s->thread_state = DONE;
 }
 
@@ -235,6 +1267,11 @@ int check_network_events(int session_idx)
 	// check if we have any new network events
 	OTResult look_result = OTLook(s->endpoint);
 
+	// the endpoint may be shared: nobody else should pick it up after this
+	if (s->ssh_conn >= 0 &&
+	    (look_result == T_RESET || look_result == T_DISCONNECT || look_result == T_ORDREL))
+		ssh_conns[s->ssh_conn].usable = 0;
+
 	switch (look_result)
 	{
 		case T_DATA:
@@ -283,12 +1320,23 @@ int ssh_setup_terminal(int session_idx)
 	struct window_context* wc = window_for_session(session_idx);
 	int cols = wc ? wc->size_x : 80;
 	int rows = wc ? wc->size_y : 24;
-	SSH_CHECK(libssh2_channel_request_pty_ex(s->channel, prefs.terminal_string, (strlen(prefs.terminal_string)), NULL, 0, cols, rows, 0, 0));
+	SSH_AGAIN(session_idx, libssh2_channel_request_pty_ex(s->channel, prefs.terminal_string, (strlen(prefs.terminal_string)), NULL, 0, cols, rows, 0, 0));
+	if (rc != LIBSSH2_ERROR_NONE)
+	{
+		printf_i("libssh2_channel_request_pty_ex failed: %s\r\n", libssh2_error_string(rc));
+		return 0;
+	}
+	conn_timing_mark(session_idx, PHASE_PTY);
 
 	/* try to set COLORTERM — server may reject this (AcceptEnv), that's OK */
-	libssh2_channel_setenv(s->channel, "COLORTERM", "truecolor");
+	SSH_AGAIN(session_idx, libssh2_channel_setenv(s->channel, "COLORTERM", "truecolor"));
 
-	SSH_CHECK(libssh2_channel_shell(s->channel));
+	SSH_AGAIN(session_idx, libssh2_channel_shell(s->channel));
+	if (rc != LIBSSH2_ERROR_NONE)
+	{
+		printf_i("libssh2_channel_shell failed: %s\r\n", libssh2_error_string(rc));
+		return 0;
+	}
 
 	s->thread_state = OPEN;
 
@@ -371,84 +1419,379 @@ char* known_hosts_full_path(int* found)
 	return NULL;
 }
 
+/* ---- known hosts index ---- */
+
+/* known_hosts is read once per run into this table and every SSH/SCP
+   connect checks against it in memory. Entries keep their file order and
+   anything we don't parse (comments, @markers) is written back untouched.
+   Changes only mark the table dirty; the write happens from the event
+   loop idle, so the connect that changed it never waits on the disk.
+   Entries are named like OpenSSH does: bare host for port 22, otherwise
+   "[host]:port". Removed entries leave a hole so indexes stay stable. */
+
+struct kh_entry {
+	char* line;              /* owned; NULL once removed */
+	const char* hosts;       /* NULL: not parsed, write line verbatim */
+	const char* type;
+	const char* key;         /* base64 key blob as stored */
+	const char* comment;     /* NULL if none */
+};
+
+#define KH_LINE_MAX 4096
+#define KH_MEMO 8
+#define KH_RETRY_TICKS (60L * 10)
+
+enum { KH_NOTFOUND, KH_MATCH, KH_MISMATCH };
+
+static struct kh_entry* kh_entries = NULL;
+static int kh_count = 0;
+static int kh_alloc = 0;
+static int kh_loaded = 0;
+static int kh_dirty = 0;
+static unsigned long kh_retry_at = 0;
+static char* kh_path = NULL;
+
+/* recently matched entries, checked before scanning the whole table */
+static int kh_memo[KH_MEMO] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int kh_memo_next = 0;
+
+/* split "hosts type key [comment]" in place; leaves hosts NULL if the
+   line isn't a plain entry */
+static void kh_parse(struct kh_entry* e)
+{
+	char* p = e->line;
+	char* start[3];
+	char* stop[3];
+	int i;
+
+	e->hosts = NULL;
+	while (*p == ' ' || *p == '\t') p++;
+	if (*p == '\0' || *p == '#' || *p == '@') return;
+
+	for (i = 0; i < 3; i++)
+	{
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '\0') return;
+		start[i] = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t') p++;
+		stop[i] = p;
+	}
+
+	while (*p == ' ' || *p == '\t') p++;
+	e->comment = (*p != '\0') ? p : NULL;
+
+	for (i = 0; i < 3; i++) *stop[i] = '\0';
+	e->hosts = start[0];
+	e->type = start[1];
+	e->key = start[2];
+}
+
+/* takes ownership of line */
+static int kh_append(char* line)
+{
+	if (kh_count == kh_alloc)
+	{
+		int n = kh_alloc ? kh_alloc * 2 : 32;
+		struct kh_entry* grown = realloc(kh_entries, n * sizeof(struct kh_entry));
+		if (grown == NULL)
+		{
+			free(line);
+			return -1;
+		}
+		kh_entries = grown;
+		kh_alloc = n;
+	}
+
+	kh_entries[kh_count].line = line;
+	kh_parse(&kh_entries[kh_count]);
+	return kh_count++;
+}
+
+static void kh_remove(int i)
+{
+	if (i < 0 || i >= kh_count || kh_entries[i].line == NULL) return;
+	free(kh_entries[i].line);
+	kh_entries[i].line = NULL;
+	kh_entries[i].hosts = NULL;
+	kh_dirty = 1;
+}
+
+/* hashed host "|1|salt|hmac": HMAC-SHA1 of the name keyed by the salt */
+static int kh_hashed_match(const char* field, size_t len, const char* name)
+{
+	unsigned char salt[64];
+	unsigned char hash[32];
+	unsigned char mac[20];
+	size_t salt_len = 0, hash_len = 0;
+	const char* salt_b64 = field + 3;
+	const char* bar = memchr(salt_b64, '|', len - 3);
+
+	if (bar == NULL) return 0;
+	if (mbedtls_base64_decode(salt, sizeof(salt), &salt_len,
+		(const unsigned char*)salt_b64, bar - salt_b64) != 0) return 0;
+	if (mbedtls_base64_decode(hash, sizeof(hash), &hash_len,
+		(const unsigned char*)bar + 1, field + len - bar - 1) != 0) return 0;
+	if (hash_len != sizeof(mac)) return 0;
+
+	if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1),
+		salt, salt_len, (const unsigned char*)name, strlen(name), mac) != 0) return 0;
+
+	return memcmp(mac, hash, sizeof(mac)) == 0;
+}
+
+/* does any of the comma separated host patterns name this host */
+static int kh_host_match(const char* hosts, const char* name)
+{
+	size_t name_len = strlen(name);
+	const char* p = hosts;
+
+	while (*p != '\0')
+	{
+		const char* comma = strchr(p, ',');
+		size_t len = comma ? (size_t)(comma - p) : strlen(p);
+
+		if (len > 3 && strncmp(p, "|1|", 3) == 0)
+		{
+			if (kh_hashed_match(p, len, name)) return 1;
+		}
+		else if (len == name_len && strncmp(p, name, len) == 0)
+		{
+			return 1;
+		}
+
+		if (comma == NULL) break;
+		p = comma + 1;
+	}
+
+	return 0;
+}
+
+/* same outcome as libssh2_knownhost_check: a match on any entry wins,
+   otherwise any entry for the host with another key is a mismatch */
+static int kh_check(const char* name, const char* key_b64, int* which)
+{
+	int found = KH_NOTFOUND;
+	int i;
+
+	for (i = 0; i < KH_MEMO; i++)
+	{
+		int m = kh_memo[i];
+		if (m < 0 || kh_entries[m].hosts == NULL) continue;
+		if (strcmp(kh_entries[m].key, key_b64) == 0 && kh_host_match(kh_entries[m].hosts, name))
+		{
+			*which = m;
+			return KH_MATCH;
+		}
+	}
+
+	for (i = 0; i < kh_count; i++)
+	{
+		struct kh_entry* e = &kh_entries[i];
+		if (e->hosts == NULL || !kh_host_match(e->hosts, name)) continue;
+
+		if (strcmp(e->key, key_b64) == 0)
+		{
+			kh_memo[kh_memo_next] = i;
+			kh_memo_next = (kh_memo_next + 1) % KH_MEMO;
+			*which = i;
+			return KH_MATCH;
+		}
+		found = KH_MISMATCH;
+	}
+
+	return found;
+}
+
+static const char* kh_key_name(int key_type)
+{
+	switch (key_type)
+	{
+		case LIBSSH2_HOSTKEY_TYPE_RSA:       return "ssh-rsa";
+		case LIBSSH2_HOSTKEY_TYPE_DSS:       return "ssh-dss";
+		case LIBSSH2_HOSTKEY_TYPE_ECDSA_256: return "ecdsa-sha2-nistp256";
+		case LIBSSH2_HOSTKEY_TYPE_ECDSA_384: return "ecdsa-sha2-nistp384";
+		case LIBSSH2_HOSTKEY_TYPE_ECDSA_521: return "ecdsa-sha2-nistp521";
+		case LIBSSH2_HOSTKEY_TYPE_ED25519:   return "ssh-ed25519";
+		default:                             return "ssh-unknown";
+	}
+}
+
+static int kh_add(const char* name, const char* type, const char* key_b64)
+{
+	size_t len = strlen(name) + strlen(type) + strlen(key_b64) + 3;
+	char* line = malloc(len);
+
+	if (line == NULL) return -1;
+	snprintf(line, len, "%s %s %s", name, type, key_b64);
+	if (kh_append(line) < 0) return -1;
+
+	kh_dirty = 1;
+	return 0;
+}
+
+/* read the file the first time anybody connects */
+static void kh_load(int session_idx)
+{
+	int exists = 0;
+	char* buf;
+	FILE* f;
+
+	if (kh_loaded) return;
+	kh_loaded = 1;
+
+	kh_path = known_hosts_full_path(&exists);
+	if (!exists || kh_path == NULL)
+	{
+		printf_s(session_idx, "No known hosts file found.\r\n");
+		return;
+	}
+
+	f = fopen(kh_path, "r");
+	buf = malloc(KH_LINE_MAX);
+	if (f == NULL || buf == NULL)
+	{
+		printf_s(session_idx, "Failed to load known hosts file.\r\n");
+		if (f != NULL) fclose(f);
+		free(buf);
+		return;
+	}
+
+	while (fgets(buf, KH_LINE_MAX, f) != NULL)
+	{
+		size_t len = strlen(buf);
+		char* line;
+
+		while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) buf[--len] = '\0';
+
+		line = malloc(len + 1);
+		if (line == NULL) break;
+		memcpy(line, buf, len + 1);
+		if (kh_append(line) < 0) break;
+	}
+
+	fclose(f);
+	free(buf);
+}
+
+/* Write the table back if an entry changed. Called from the event loop
+   idle; a failed write is retried a little later rather than every pass.
+   force skips the retry delay (used on quit). */
+void known_hosts_flush(int force)
+{
+	FILE* f;
+	int i, ok;
+
+	if (!kh_dirty || kh_path == NULL) return;
+	if (!force && kh_retry_at != 0 && (long)(TickCount() - kh_retry_at) < 0) return;
+
+	f = fopen(kh_path, "w");
+	ok = (f != NULL);
+
+	for (i = 0; ok && i < kh_count; i++)
+	{
+		struct kh_entry* e = &kh_entries[i];
+
+		if (e->line == NULL) continue;
+		if (e->hosts == NULL)
+			ok = fprintf(f, "%s\n", e->line) >= 0;
+		else if (e->comment != NULL)
+			ok = fprintf(f, "%s %s %s %s\n", e->hosts, e->type, e->key, e->comment) >= 0;
+		else
+			ok = fprintf(f, "%s %s %s\n", e->hosts, e->type, e->key) >= 0;
+	}
+
+	if (f != NULL && fclose(f) != 0) ok = 0;
+
+	if (ok)
+	{
+		kh_dirty = 0;
+		kh_retry_at = 0;
+	}
+	else
+	{
+		kh_retry_at = TickCount() + KH_RETRY_TICKS;
+	}
+}
+
 static int known_hosts(int session_idx, const char* host, int port)
 {
 	struct session* s = &sessions[session_idx];
 	int safe_to_connect = 1;
 	int recognized_key = 0;
-	int known_hosts_file_exists = 0;
+	int legacy_entry = -1;
+	int which = -1;
+	int e = KH_NOTFOUND;
 
-	char* known_hosts_file_path = known_hosts_full_path(&known_hosts_file_exists);
 	char* hash_string = NULL;
+	char* key_b64 = NULL;
+	char name[280];
 
 	size_t key_len = 0;
 	int key_type = 0;
 	const char* host_key = libssh2_session_hostkey(s->ssh_session, &key_len, &key_type);
 
-	LIBSSH2_KNOWNHOSTS* kh = libssh2_knownhost_init(s->ssh_session);
+	kh_load(session_idx);
+
+	/* port-aware name: [host]:port for non-22, bare host for 22 */
+	if (port != 22)
+		snprintf(name, sizeof(name), "[%s]:%d", host, port);
+	else
+		strncpy(name, host, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
 
-	if (known_hosts_file_exists && known_hosts_file_path != NULL)
+	if (host_key != NULL)
 	{
-		int e = libssh2_knownhost_readfile(kh, known_hosts_file_path, LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-		if (e < 0)
+		size_t b64_len = 4 * ((key_len + 2) / 3) + 1;
+		size_t out_len = 0;
+		key_b64 = malloc(b64_len);
+		if (key_b64 != NULL && mbedtls_base64_encode((unsigned char*)key_b64, b64_len, &out_len,
+			(const unsigned char*)host_key, key_len) != 0)
 		{
-			printf_s(session_idx, "Failed to load known hosts file: %s\r\n", libssh2_error_string(e));
+			free(key_b64);
+			key_b64 = NULL;
 		}
 	}
-	else
+
+	if (key_b64 == NULL)
 	{
-		printf_s(session_idx, "No known hosts file found.\r\n");
+		printf_s(session_idx, "Failed to check known hosts against server public key!\r\n");
+		safe_to_connect = 0;
 	}
 
 	if (safe_to_connect)
 	{
-		/* port-aware check: checkp uses [host]:port for non-22, bare host for 22 */
-		struct libssh2_knownhost* knownhost = NULL;
-		int e = libssh2_knownhost_checkp(kh, host, port, host_key, key_len,
-			LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW, &knownhost);
+		e = kh_check(name, key_b64, &which);
 
 		/* legacy migration for non-22 ports: old entries saved as bare hostname */
-		if (e == LIBSSH2_KNOWNHOST_CHECK_NOTFOUND && port != 22)
+		if (e == KH_NOTFOUND && port != 22)
 		{
-			struct libssh2_knownhost* legacy = NULL;
-			int fb = libssh2_knownhost_check(kh, host, host_key, key_len,
-				LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW, &legacy);
+			int fb = kh_check(host, key_b64, &which);
 
-			if (fb == LIBSSH2_KNOWNHOST_CHECK_MATCH)
+			if (fb == KH_MATCH)
 			{
-				/* silently upgrade: delete legacy bare-host entry, re-save with port */
-				if (legacy) libssh2_knownhost_del(kh, legacy);
-				e = LIBSSH2_KNOWNHOST_CHECK_NOTFOUND; /* fall through to "new host" dialog to re-add with port */
-				recognized_key = 0;
+				/* re-save with port once the user accepts; the bare entry goes then */
+				legacy_entry = which;
 			}
-			else if (fb == LIBSSH2_KNOWNHOST_CHECK_MISMATCH)
+			else if (fb == KH_MISMATCH)
 			{
 				/* hard-fail: key changed regardless of how it was stored */
-				e = LIBSSH2_KNOWNHOST_CHECK_MISMATCH;
+				e = KH_MISMATCH;
 			}
 			/* fallback NOTFOUND: proceed with normal "new host" dialog */
 		}
 
 		switch (e)
 		{
-			case LIBSSH2_KNOWNHOST_CHECK_FAILURE:
-				printf_s(session_idx, "Failed to check known hosts against server public key!\r\n");
-				safe_to_connect = 0;
-				break;
-			case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND:
+			case KH_NOTFOUND:
 				printf_s(session_idx, "No matching host found.\r\n");
 				break;
-			case LIBSSH2_KNOWNHOST_CHECK_MATCH:
+			case KH_MATCH:
 				recognized_key = 1;
 				break;
-			case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:
+			case KH_MISMATCH:
 				printf_s(session_idx, "WARNING! Host found in known hosts but key doesn't match!\r\n");
 				safe_to_connect = 0;
 				break;
-			default:
-				printf_s(session_idx, "Unexpected error while checking known-hosts: %d\r\n", e);
-				safe_to_connect = 0;
-				break;
 		}
 	}
 
@@ -488,126 +1831,352 @@ static int known_hosts(int session_idx, const char* host, int port)
 
 		printf_s(session_idx, "Saving host and key... ");
 
+		/* only the in-memory table changes here, the file is written
+		   from the event loop once we're back to idle */
+		kh_remove(legacy_entry);
+		if (kh_add(name, kh_key_name(key_type), key_b64) != 0)
+			printf_s(session_idx, "failed to add to known hosts.\r\n");
+		else if (kh_path == NULL)
+			printf_s(session_idx, "failed to resolve known hosts file path.\r\n");
+		else
+			printf_s(session_idx, "done.\r\n");
+	}
+
+kh_done:
+	free(hash_string);
+	free(key_b64);
+
+	return safe_to_connect;
+}
+
+/* ---- private key cache ---- */
+
+/* Reading and decrypting a passphrase protected key takes seconds on a
+   68030, so each key is loaded once and shared by every tab and SCP
+   worker. Keys mbedtls can open are kept re-encoded as unencrypted PEM,
+   so later logins only parse them; anything else (OpenSSH format keys)
+   is kept as read and libssh2 still decrypts it per login. An entry is
+   only reused with the passphrase that opened it. prefs.key_cache_minutes
+   limits how long an entry lives: 0 = cache off, -1 = no limit. */
+
+#define KEY_CACHE_SLOTS 4
+#define KEY_FILE_MAX 16384
+#define KEY_PEM_MAX 16384
+
+struct key_cache_entry {
+	char* privkey_path;              /* NULL = free slot */
+	char* pubkey_path;
+	unsigned char pass_digest[32];   /* SHA-256 of the passphrase */
+	char* pub;                       /* NULL: derive from private key */
+	size_t pub_len;
+	char* priv;                      /* always NUL terminated */
+	size_t priv_len;
+	int decrypted;                   /* priv needs no passphrase */
+	int users;                       /* logins in progress using it */
+	int stale;                       /* drop once users reaches 0 */
+	unsigned long loaded_at;
+};
+
+static struct key_cache_entry key_cache[KEY_CACHE_SLOTS];
+
+static void key_cache_free(struct key_cache_entry* k)
+{
+	if (k->priv != NULL)
+	{
+		mbedtls_platform_zeroize(k->priv, k->priv_len);
+		free(k->priv);
+	}
+	free(k->pub);
+	free(k->privkey_path);
+	free(k->pubkey_path);
+	memset(k, 0, sizeof(*k));
+}
+
+static void key_cache_drop(struct key_cache_entry* k)
+{
+	if (k->users > 0) k->stale = 1;
+	else key_cache_free(k);
+}
+
+/* forget every cached key (cache switched off or changed) */
+void key_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < KEY_CACHE_SLOTS; i++)
+		if (key_cache[i].privkey_path != NULL)
+			key_cache_drop(&key_cache[i]);
+}
+
+/* drop keys past their lifetime; cheap enough to run every idle pass */
+void key_cache_expire(void)
+{
+	long limit = (long)prefs.key_cache_minutes * 60 * 60;
+	int i;
+
+	if (prefs.key_cache_minutes < 0) return;
+
+	for (i = 0; i < KEY_CACHE_SLOTS; i++)
+	{
+		struct key_cache_entry* k = &key_cache[i];
+		if (k->privkey_path == NULL || k->stale) continue;
+		if (limit == 0 || (long)(TickCount() - k->loaded_at) > limit)
+			key_cache_drop(k);
+	}
+}
+
+static void key_pass_digest(const char* passphrase, unsigned char* out)
+{
+	if (passphrase == NULL) passphrase = "";
+	mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+		(const unsigned char*)passphrase, strlen(passphrase), out);
+}
+
+/* whole file into a NUL terminated buffer */
+static char* key_read_file(const char* path, size_t* len)
+{
+	FILE* f = fopen(path, "rb");
+	char* buf = NULL;
+	long size;
+
+	*len = 0;
+	if (f == NULL) return NULL;
+
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && size < KEY_FILE_MAX
+		&& fseek(f, 0, SEEK_SET) == 0 && (buf = malloc(size + 1)) != NULL)
+	{
+		*len = fread(buf, 1, size, f);
+		buf[*len] = '\0';
+		if (*len == 0)
 		{
-			int save_type = 0;
-			int e;
-			save_type |= LIBSSH2_KNOWNHOST_TYPE_PLAIN;
-			save_type |= LIBSSH2_KNOWNHOST_KEYENC_RAW;
+			free(buf);
+			buf = NULL;
+		}
+	}
 
-			switch (key_type)
-			{
-				default:
-					__attribute__ ((fallthrough));
-				case LIBSSH2_HOSTKEY_TYPE_UNKNOWN:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_UNKNOWN;
-					break;
-				case LIBSSH2_HOSTKEY_TYPE_RSA:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_SSHRSA;
-					break;
-				case LIBSSH2_HOSTKEY_TYPE_DSS:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_SSHDSS;
-					break;
-				case LIBSSH2_HOSTKEY_TYPE_ECDSA_256:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_ECDSA_256;
-					break;
-				case LIBSSH2_HOSTKEY_TYPE_ECDSA_384:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_ECDSA_384;
-					break;
-				case LIBSSH2_HOSTKEY_TYPE_ECDSA_521:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_ECDSA_521;
-					break;
-				case LIBSSH2_HOSTKEY_TYPE_ED25519:
-					save_type |= LIBSSH2_KNOWNHOST_KEY_ED25519;
-					break;
-			}
+	fclose(f);
+	return buf;
+}
 
-			/* save with port-aware format: [host]:port for non-22, bare host for 22 */
-			{
-				char addc_host[280];
-				if (port != 22)
-					snprintf(addc_host, sizeof(addc_host), "[%s]:%d", host, port);
-				else
-					strncpy(addc_host, host, sizeof(addc_host) - 1);
-				addc_host[sizeof(addc_host) - 1] = '\0';
-				e = libssh2_knownhost_addc(kh, addc_host, NULL, host_key, key_len, NULL, 0, save_type, NULL);
-			}
+/* swap an encrypted PEM key for its plain re-encoding, if mbedtls can;
+   an encrypted OpenSSH key stays as it is and keeps its passphrase */
+static void key_cache_decrypt(struct key_cache_entry* k, const char* passphrase)
+{
+	mbedtls_pk_context pk;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_entropy_context entropy;
+	unsigned char* pem;
 
-			if (e != 0) printf_s(session_idx, "failed to add to known hosts: %s\r\n", libssh2_error_string(e));
-			else if (known_hosts_file_path == NULL)
-				printf_s(session_idx, "failed to resolve known hosts file path.\r\n");
-			else
-			{
-				e = libssh2_knownhost_writefile(kh, known_hosts_file_path, LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-				if (e != 0) printf_s(session_idx, "failed to save known hosts file: %s\r\n", libssh2_error_string(e));
-				else printf_s(session_idx, "done.\r\n");
-			}
+	if (!key_encrypted(k->priv))
+	{
+		k->decrypted = 1;
+		return;
+	}
+	if (passphrase == NULL || (pem = malloc(KEY_PEM_MAX)) == NULL) return;
+
+	mbedtls_pk_init(&pk);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_entropy_init(&entropy);
+
+	if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) == 0
+		&& mbedtls_pk_parse_key(&pk, (const unsigned char*)k->priv, k->priv_len + 1,
+			(const unsigned char*)passphrase, strlen(passphrase),
+			mbedtls_ctr_drbg_random, &ctr_drbg) == 0
+		&& mbedtls_pk_write_key_pem(&pk, pem, KEY_PEM_MAX) == 0)
+	{
+		size_t len = strlen((char*)pem);
+		char* plain = malloc(len + 1);
+
+		if (plain != NULL)
+		{
+			memcpy(plain, pem, len + 1);
+			mbedtls_platform_zeroize(k->priv, k->priv_len);
+			free(k->priv);
+			k->priv = plain;
+			k->priv_len = len;
+			k->decrypted = 1;
 		}
 	}
 
-kh_done:
-	free(hash_string);
+	mbedtls_platform_zeroize(pem, KEY_PEM_MAX);
+	free(pem);
+	mbedtls_pk_free(&pk);
+	mbedtls_ctr_drbg_free(&ctr_drbg);
+	mbedtls_entropy_free(&entropy);
+}
+
+static int key_path_eq(const char* a, const char* b)
+{
+	return strcmp(a ? a : "", b ? b : "") == 0;
+}
 
-	libssh2_knownhost_free(kh);
+static struct key_cache_entry* key_cache_get(const struct ssh_auth_params* auth)
+{
+	unsigned char digest[32];
+	struct key_cache_entry* k = NULL;
+	int i;
 
-	free(known_hosts_file_path);
+	key_pass_digest(auth->password, digest);
 
-	return safe_to_connect;
+	for (i = 0; i < KEY_CACHE_SLOTS; i++)
+	{
+		struct key_cache_entry* c = &key_cache[i];
+		if (c->privkey_path != NULL && !c->stale
+			&& key_path_eq(c->privkey_path, auth->privkey_path)
+			&& key_path_eq(c->pubkey_path, auth->pubkey_path)
+			&& memcmp(c->pass_digest, digest, sizeof(digest)) == 0)
+			return c;
+	}
+
+	/* miss: take a free slot, else evict the oldest idle one */
+	for (i = 0; i < KEY_CACHE_SLOTS; i++)
+	{
+		struct key_cache_entry* c = &key_cache[i];
+		if (c->privkey_path == NULL) { k = c; break; }
+		if (c->users == 0 && (k == NULL || (long)(c->loaded_at - k->loaded_at) < 0)) k = c;
+	}
+	if (k == NULL) return NULL;
+	if (k->privkey_path != NULL) key_cache_free(k);
+
+	k->priv = key_read_file(auth->privkey_path, &k->priv_len);
+	if (k->priv == NULL) return NULL;
+
+	if (auth->pubkey_path != NULL && auth->pubkey_path[0] != '\0')
+	{
+		k->pub = key_read_file(auth->pubkey_path, &k->pub_len);
+		if (k->pub == NULL)
+		{
+			key_cache_free(k);
+			return NULL;
+		}
+	}
+
+	k->privkey_path = strdup(auth->privkey_path);
+	k->pubkey_path = strdup(auth->pubkey_path ? auth->pubkey_path : "");
+	if (k->privkey_path == NULL || k->pubkey_path == NULL)
+	{
+		key_cache_free(k);
+		return NULL;
+	}
+
+	memcpy(k->pass_digest, digest, sizeof(digest));
+	key_cache_decrypt(k, auth->password);
+	k->loaded_at = TickCount();
+	return k;
 }
 
+/* public key login, from the cache when it's on */
+static int key_cache_auth(int session_idx, const struct ssh_auth_params* auth)
+{
+	struct session* s = &sessions[session_idx];
+	struct key_cache_entry* k;
+	int rc;
+
+	key_cache_expire();
+
+	/* cache off, unreadable key or every slot busy: straight from disk */
+	if (prefs.key_cache_minutes == 0 || auth->privkey_path == NULL
+		|| (k = key_cache_get(auth)) == NULL)
+	{
+		return libssh2_userauth_publickey_fromfile_ex(s->ssh_session,
+			auth->username,
+			strlen(auth->username),
+			auth->pubkey_path,
+			auth->privkey_path,
+			auth->password);
+	}
+
+	/* libssh2 reads priv again when it signs, after yielding for the
+	   network, so keep the entry pinned until the login is over */
+	k->users++;
+	rc = libssh2_userauth_publickey_frommemory(s->ssh_session,
+		auth->username,
+		strlen(auth->username),
+		k->pub, k->pub_len,
+		k->priv, k->priv_len,
+		k->decrypted ? NULL : auth->password);
+	k->users--;
+
+	/* don't keep a key that didn't work, the file may get fixed */
+	if (rc != LIBSSH2_ERROR_NONE) k->stale = 1;
+	if (k->stale && k->users == 0) key_cache_free(k);
+
+	return rc;
+}
 
 ssize_t network_recv_callback(libssh2_socket_t sock, void *buffer,
                size_t length, int flags, void **abstract)
 {
-	int idx = (int)(intptr_t)*abstract;
-	struct session* s = &sessions[idx];
+	int ci = (int)(intptr_t)*abstract;
+	struct ssh_conn* c = &ssh_conns[ci];
+	int idx = ssh_conn_current_session(ci);
 	OTResult ret = kOTNoDataErr;
 	OTFlags ot_flags = 0;
 
 	if (length == 0) return 0;
 
 	// in non-blocking mode, returns instantly always
-	ret = OTRcv(s->endpoint, buffer, length, &ot_flags);
-
-	// if we got bytes, return them
-	if (ret >= 0) return ret;
+	// clear the reader's flag first so a notification racing this call
+	// isn't lost
+	if (idx >= 0) sessions[idx].net_ready = 0;
+	ret = OTRcv(c->endpoint, buffer, length, &ot_flags);
+
+	// got bytes: they may belong to any channel on this connection, so
+	// let the other readers check theirs
+	if (ret >= 0)
+	{
+		c->traffic.wire_in += ret;
+		ssh_conn_kick(ci, idx);
+		return ret;
+	}
 
-	// if no data, let other threads run, then tell caller to call again
-	if (ret == kOTNoDataErr && s->thread_command != EXIT)
+	// if no data, tell caller to call again. only a blocking call on a
+	// session's own thread (handshake and auth, before the connection is
+	// shared) sleeps here; non-blocking callers drain opportunistically
+	// and must get EAGAIN straight away
+	if (ret == kOTNoDataErr && (idx < 0 || sessions[idx].thread_command != EXIT))
 	{
-		YieldToAnyThread();
+		if (idx >= 0 && libssh2_session_get_blocking(c->session))
+			tcp_wait_readable(idx);
 		return -EAGAIN;
 	}
 
 	// if we got anything other than data or nothing, return an error
-	if (ret != kOTNoDataErr) return -1;
-
+	c->usable = 0;
 	return -1;
 }
 
 ssize_t network_send_callback(libssh2_socket_t sock, const void *buffer,
                size_t length, int flags, void **abstract)
 {
-	int idx = (int)(intptr_t)*abstract;
-	struct session* s = &sessions[idx];
+	int ci = (int)(intptr_t)*abstract;
+	struct ssh_conn* c = &ssh_conns[ci];
 	int ret = -1;
 
-	ret = OTSnd(s->endpoint, (void*) buffer, length, 0);
+	ret = OTSnd(c->endpoint, (void*) buffer, length, 0);
 
 	if (ret == kOTLookErr)
 	{
-		OTResult lookresult = OTLook(s->endpoint);
+		OTResult lookresult = OTLook(c->endpoint);
 		(void)lookresult;
 		return -1;
 	}
 
-	/* flow control: send buffer full. yield so OT can drain,
-	   then tell libssh2 to retry (same pattern as recv callback) */
+	/* flow control: send buffer full. tell libssh2 to retry; in blocking
+	   mode yield first so OT can drain. non-blocking callers yield in
+	   their own loops, outside libssh2, where other channels may run */
 	if (ret == kOTFlowErr)
 	{
-		YieldToAnyThread();
+		if (libssh2_session_get_blocking(c->session))
+			YieldToAnyThread();
 		return -EAGAIN;
 	}
 
+	if (ret < 0)
+		c->usable = 0;
+	else
+		c->traffic.wire_out += ret;
+
 	return (ssize_t) ret;
 }
 
@@ -618,7 +2187,7 @@ void ssh_end_msg_callback(LIBSSH2_SESSION* session, int reason, const char *mess
 	printf_i("got a disconnect msg\r\n");
 }
 
-int init_connection(int session_idx, char* hostname)
+static int init_connection(int session_idx, char* hostname, int profile)
 {
 	struct session* s = &sessions[session_idx];
 	int rc;
@@ -626,66 +2195,100 @@ int init_connection(int session_idx, char* hostname)
 	// OT vars
 	OSStatus err = noErr;
 	TCall sndCall;
-	DNSAddress hostDNSAddress;
+	InetAddress hostAddress;
+	int ci;
+	struct ssh_conn* c;
 
+	ci = ssh_conn_alloc(session_idx);
+	if (ci < 0)
+	{
+		printf_s(session_idx, "Too many SSH connections.\r\n");
+		return 0;
+	}
+	c = &ssh_conns[ci];
 
 	// open TCP endpoint
-	s->endpoint = OTOpenEndpoint(OTCreateConfiguration(kTCPName), 0, nil, &err);
+	s->endpoint = c->endpoint = OTOpenEndpoint(OTCreateConfiguration(kTCPName), 0, nil, &err);
 
 	if (err != noErr || s->endpoint == kOTInvalidEndpointRef)
 	{
 		printf_s(session_idx, "Failed to open Open Transport TCP endpoint.\r\n");
+		s->endpoint = c->endpoint = kOTInvalidEndpointRef;
 		return 0;
 	}
 
 	OT_CHECK(OTSetSynchronous(s->endpoint));
 	OT_CHECK(OTSetBlocking(s->endpoint));
+	OT_CHECK(OTInstallNotifier(s->endpoint, ssh_conn_notifier,
+	                           (void*)(intptr_t)(ci + 1)));
 	OT_CHECK(OTUseSyncIdleEvents(s->endpoint, false));
 
 	OT_CHECK(OTBind(s->endpoint, nil, nil));
 
 	OT_CHECK(OTSetNonBlocking(s->endpoint));
 
-	// set up address struct, do the DNS lookup, and connect
+	// do the DNS lookup (or take it from the cache), set up address struct, and connect
+	printf_s(session_idx, "Connecting to endpoint \"%s\"... ", hostname); YieldToAnyThread();
+	err = dns_resolve_hostport(session_idx, hostname, &hostAddress);
+	if (err != noErr)
+	{
+		printf_s(session_idx, "DNS lookup failed (err=%d)\r\n", (int)err);
+		return 0;
+	}
+	conn_timing_mark(session_idx, PHASE_DNS);
+
 	OTMemzero(&sndCall, sizeof(TCall));
 
-	sndCall.addr.buf = (UInt8 *) &hostDNSAddress;
-	sndCall.addr.len = OTInitDNSAddress(&hostDNSAddress, (char *) hostname);
+	sndCall.addr.buf = (UInt8 *) &hostAddress;
+	sndCall.addr.len = sizeof(InetAddress);
 
-	printf_s(session_idx, "Connecting to endpoint \"%s\"... ", hostname); YieldToAnyThread();
 	err = OTConnect(s->endpoint, &sndCall, nil);
 	if (err != noErr)
 	{
 		printf_s(session_idx, "OTConnect failed (err=%d)\r\n", (int)err);
+		dns_connect_failed(hostname);
 		return 0;
 	}
+	conn_timing_mark(session_idx, PHASE_TCP);
 	printf_s(session_idx, "done.\r\n"); YieldToAnyThread();
 
 	// init libssh2
 	SSH_CHECK(libssh2_init(0));
 	YieldToAnyThread();
 
-	s->ssh_session = libssh2_session_init();
+	s->ssh_session = c->session = libssh2_session_init();
 	if (s->ssh_session == 0)
 	{
 		printf_s(session_idx, "Failed to initialize SSH session.\r\n");
+		libssh2_exit();
 		return 0;
 	}
 	YieldToAnyThread();
 
-	// store session index in libssh2 abstract pointer for use in callbacks
-	*libssh2_session_abstract(s->ssh_session) = (void*)(intptr_t)session_idx;
+	// store connection index in libssh2 abstract pointer for use in callbacks
+	*libssh2_session_abstract(s->ssh_session) = (void*)(intptr_t)ci;
 
 	// register callbacks
 	libssh2_session_callback_set(s->ssh_session, LIBSSH2_CALLBACK_SEND, network_send_callback);
 	libssh2_session_callback_set(s->ssh_session, LIBSSH2_CALLBACK_RECV, network_recv_callback);
 	libssh2_session_callback_set(s->ssh_session, LIBSSH2_CALLBACK_DISCONNECT, ssh_end_msg_callback);
 
+	ssh_apply_profile(session_idx, profile);
+	if (ssh_want_compress(s)) ssh_offer_compression(session_idx);
+
 	long st = TickCount();
 	printf_s(session_idx, "Beginning SSH session handshake... "); YieldToAnyThread();
 	SSH_CHECK(libssh2_session_handshake(s->ssh_session, 0));
 
-	printf_s(session_idx, "done. (%d ticks)\r\n", TickCount() - st); YieldToAnyThread();
+	conn_timing_mark(session_idx, PHASE_HANDSHAKE);
+	ssh_record_algos(session_idx, TickCount() - st);
+	printf_s(session_idx, "done. (%ld ticks)\r\n", s->ssh_algos.handshake_ticks);
+	printf_s(session_idx, "Using %s, %s, %s, %s\r\n", s->ssh_algos.kex,
+		s->ssh_algos.hostkey, s->ssh_algos.cipher_sc, s->ssh_algos.mac_sc);
+	if (ssh_want_compress(s))
+		printf_s(session_idx, "Compression: %s%s\r\n", s->ssh_algos.comp,
+			strcmp(s->ssh_algos.comp, "none") == 0 ? " (not agreed with server)" : "");
+	YieldToAnyThread();
 
 	//const char* banner = libssh2_session_banner_get(s->ssh_session);
 	//if (banner) printf_s(session_idx, "Server banner: %s\r\n", banner);
@@ -693,18 +2296,55 @@ int init_connection(int session_idx, char* hostname)
 	return 1;
 }
 
+const char* bench_profile(int profile)
+{
+	if (profile < 0 || profile >= SSH_PROFILE_COUNT) return NULL;
+	return ssh_profiles[profile].name;
+}
+
+long bench_connect(int session_idx, const char* hostport, int profile,
+                   char* algos, int algos_size)
+{
+	struct session* s = &sessions[session_idx];
+	long ms = -1;
+
+	if (init_connection(session_idx, (char*)hostport, profile))
+	{
+		ms = s->ssh_algos.handshake_ticks * 1000L / 60;
+		snprintf(algos, algos_size, "%s %s %s %s", s->ssh_algos.kex,
+			s->ssh_algos.hostkey, s->ssh_algos.cipher_sc, s->ssh_algos.mac_sc);
+	}
+
+	/* the benchmark worker keeps running after each round */
+	end_connection(session_idx);
+	s->thread_state = OPEN;
+	return ms;
+}
+
 int ssh_connect_and_auth(int session_idx, const struct ssh_auth_params* auth)
 {
 	struct session* s = &sessions[session_idx];
 	int ok = 1;
 	int rc = LIBSSH2_ERROR_NONE;
+	char key[300];
+
+	/* already logged in there? just open another channel on that session */
+	snprintf(key, sizeof(key), "%s@%s:%d", auth->username, auth->host_only, auth->port);
+	conn_timing_begin(session_idx, s->worker_mode == WORKER_SCP ? "scp" :
+		s->worker_mode == WORKER_SFTP ? "sftp" : "ssh", key);
+	if (ssh_conn_attach(session_idx, key, prefs.ssh_profile, ssh_want_compress(s)))
+	{
+		printf_s(session_idx, "Sharing connection to %s\r\n", key);
+		return 1;
+	}
 
 	/* TCP + SSH handshake */
 	printf_s(session_idx, "Connecting to: \"%s\"\r\n", auth->hostname);
-	ok = init_connection(session_idx, (char*)auth->hostname);
+	ok = init_connection(session_idx, (char*)auth->hostname, prefs.ssh_profile);
 
 	if (!ok)
 	{
+		conn_timing_end(session_idx, 0);
 		end_connection(session_idx);
 		return 0;
 	}
@@ -715,6 +2355,7 @@ int ssh_connect_and_auth(int session_idx, const struct ssh_auth_params* auth)
 	if (ok)
 	{
 		ok = known_hosts(session_idx, auth->host_only, auth->port);
+		conn_timing_mark(session_idx, PHASE_HOSTKEY);
 		if (!ok) printf_s(session_idx, "Rejected server public key!\r\n");
 	}
 
@@ -729,16 +2370,12 @@ int ssh_connect_and_auth(int session_idx, const struct ssh_auth_params* auth)
 		}
 		else
 		{
-			rc = libssh2_userauth_publickey_fromfile_ex(s->ssh_session,
-				auth->username,
-				strlen(auth->username),
-				auth->pubkey_path,
-				auth->privkey_path,
-				auth->password);
+			rc = key_cache_auth(session_idx, auth);
 		}
 
 		if (rc == LIBSSH2_ERROR_NONE)
 		{
+			conn_timing_mark(session_idx, PHASE_AUTH);
 			printf_s(session_idx, "done.\r\n");
 		}
 		else
@@ -758,18 +2395,39 @@ int ssh_connect_and_auth(int session_idx, const struct ssh_auth_params* auth)
 
 	if (!ok)
 	{
+		conn_timing_end(session_idx, 0);
 		end_connection(session_idx);
 		return 0;
 	}
 
+	/* from here on the session may carry several channels, each driven
+	   by its own thread, so nobody may block inside libssh2 */
+	libssh2_session_set_blocking(s->ssh_session, 0);
+	{
+		struct ssh_conn* c = &ssh_conns[s->ssh_conn];
+		snprintf(c->key, sizeof(c->key), "%s", key);
+		c->profile = prefs.ssh_profile;
+		c->compress = ssh_want_compress(s);
+		c->usable = 1;
+	}
+
 	return 1;
 }
 
 void ssh_request_pty_resize(int session_idx, int cols, int rows)
 {
 	struct session* s = &sessions[session_idx];
-	if (s->channel)
-		libssh2_channel_request_pty_size(s->channel, cols, rows);
+	long deadline = TickCount() + 60;
+	int rc;
+
+	while (s->channel)
+	{
+		ssh_conn_begin(session_idx);
+		rc = libssh2_channel_request_pty_size(s->channel, cols, rows);
+		ssh_conn_end(session_idx, rc);
+		if (rc != LIBSSH2_ERROR_EAGAIN || TickCount() >= deadline) break;
+		YieldToAnyThread();
+	}
 }
 
 void* read_thread(void* arg)
@@ -843,17 +2501,33 @@ void* read_thread(void* arg)
 	/* open channel and set up terminal */
 	if (ok)
 	{
-		s->channel = libssh2_channel_open_session(s->ssh_session);
+		while (1)
+		{
+			s->net_ready = 0;
+			ssh_conn_begin(session_idx);
+			s->channel = libssh2_channel_open_session(s->ssh_session);
+			ssh_conn_end(session_idx, s->channel ? 0 : libssh2_session_last_errno(s->ssh_session));
+			if (s->channel != NULL || s->thread_command == EXIT) break;
+			if (libssh2_session_last_errno(s->ssh_session) != LIBSSH2_ERROR_EAGAIN) break;
+			tcp_wait_readable(session_idx);
+		}
+
 		if (s->channel)
 		{
+			conn_timing_mark(session_idx, PHASE_CHANNEL);
 			libssh2_channel_handle_extended_data2(s->channel, LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
 			ok = ssh_setup_terminal(session_idx);
+
+			/* applies to the whole connection, shared tabs included */
+			if (ssh_keepalive_secs(session_idx) > 0)
+				libssh2_keepalive_config(s->ssh_session, 1, ssh_keepalive_secs(session_idx));
 		}
 		else
 		{
 			printf_s(session_idx, "Failed to open channel.\r\n");
 			ok = 0;
 		}
+		conn_timing_end(session_idx, ok && s->thread_state == OPEN);
 		YieldToAnyThread();
 	}
 
@@ -872,9 +2546,20 @@ void* read_thread(void* arg)
 		/* read until failure, command to EXIT, or remote EOF */
 		while (s->thread_command == READ && s->thread_state == OPEN && libssh2_channel_eof(s->channel) == 0)
 		{
-			if (check_network_events(session_idx)) ssh_read(session_idx);
-			YieldToAnyThread();
+			int pending;
+
+			if (!check_network_events(session_idx)) break;
+
+			pending = session_flush_output(session_idx, 0);
+			if (!pending && ssh_keepalive_secs(session_idx) > 0)
+				ssh_keepalive_tick(session_idx);
+			if (ssh_read(session_idx) || (pending && !s->out_blocked))
+				YieldToAnyThread();
+			else
+				tcp_wait_readable(session_idx);
 		}
+		session_output_discard(session_idx);
+		s->wake_at = 0;
 
 		if (s->channel && libssh2_channel_eof(s->channel))
 		{
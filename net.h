@@ -7,8 +7,13 @@
 
 #pragma once
 
-void ssh_write(char* buf, size_t len);
-void ssh_write_s(int session_idx, char* buf, size_t len);
+void session_send(int session_idx, const char* buf, size_t len);
+int session_flush_output(int session_idx, int force);
+int session_has_output(int session_idx);
+int session_output_pending(void);
+void session_output_discard(int session_idx);
+int session_paste_start(int session_idx, Handle data, long len);
+void session_paste_cancel(int session_idx);
 void* read_thread(void* arg);
 
 struct ssh_auth_params {
@@ -22,6 +27,75 @@ struct ssh_auth_params {
 	int use_key;               /* 1 = pubkey auth, 0 = password auth */
 };
 
+/* bytes moved on an SSH connection: on the wire (after compression,
+   encryption and framing) and as channel payload */
+struct ssh_traffic {
+	unsigned long wire_in;
+	unsigned long wire_out;
+	unsigned long data_in;
+	unsigned long data_out;
+};
+
+/* per-phase connection timing, shown by conninfo */
+#define CONN_TIMING_RECORDS 16
+
+enum CONN_PHASE {
+	PHASE_DNS,        /* name lookup, near 0 on a cache hit */
+	PHASE_TCP,        /* TCP connect */
+	PHASE_HANDSHAKE,  /* SSH key exchange or TLS handshake */
+	PHASE_HOSTKEY,    /* known_hosts check, including any dialog */
+	PHASE_AUTH,       /* SSH userauth, FTP USER/PASS */
+	PHASE_CHANNEL,    /* SSH channel / SCP transfer open */
+	PHASE_PTY,        /* pty request */
+	PHASE_COUNT
+};
+
+enum CONN_RESULT { CONN_PENDING, CONN_OK, CONN_FAILED };
+
+struct conn_timing {
+	unsigned long seq;          /* 0 = slot never used */
+	char kind[8];               /* "ssh", "scp", "telnet", ... */
+	char target[48];
+	long start;
+	long last;                  /* tick of the previous mark */
+	long ticks[PHASE_COUNT];    /* -1 = phase not reached or not used */
+	long total;
+	enum CONN_RESULT result;
+};
+
+void conn_timing_begin(int session_idx, const char* kind, const char* target);
+void conn_timing_mark(int session_idx, enum CONN_PHASE phase);
+void conn_timing_end(int session_idx, int ok);
+const struct conn_timing* conn_timing_get(int i);
+
+/* DNS cache shared by all connect paths */
+OSStatus dns_lookup(int session_idx, const char* name, InetHostInfo* info);
+OSStatus dns_resolve(int session_idx, const char* name, InetHost* out);
+OSStatus dns_resolve_hostport(int session_idx, const char* hostport,
+                              InetAddress* addr);
+void dns_connect_failed(const char* hostport);
+void dns_cache_store(const char* name, InetHost addr);
+void dns_cache_forget(const char* name);
+int dns_cache_flush(void);
+int dns_cache_entry(int i, const char** name, InetHost* addr, long* ttl_ticks);
+
+void known_hosts_flush(int force);
+void key_cache_expire(void);
+void key_cache_flush(void);
+
 int ssh_connect_and_auth(int session_idx, const struct ssh_auth_params* auth);
+void ssh_conn_begin(int session_idx);
+void ssh_conn_end(int session_idx, int rc);
+void ssh_conn_wait(int session_idx);
+const char* ssh_conn_info(int session_idx, int* users);
+void ssh_conn_count(int session_idx, long in, long out);
+int ssh_conn_traffic(int session_idx, struct ssh_traffic* t);
+void ssh_set_next_options(int compress, int keepalive);
+void ssh_take_options(int session_idx);
+int ssh_keepalive_secs(int session_idx);
+const char* ssh_profile_name(int profile);
+int ssh_profile_lookup(const char* name);
 void ssh_request_pty_resize(int session_idx, int cols, int rows);
+int ssh_channel_close(int session_idx, LIBSSH2_CHANNEL* channel, int wait_eof);
+void ssh_channel_done(int session_idx);
 void end_connection(int session_idx);
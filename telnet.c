@@ -8,74 +8,61 @@
 #include "telnet.h"
 #include "console.h"
 #include "debug.h"
+#include "filter.h"
+#include "iac.h"
+#include "inflate.h"
+#include "net.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <Processes.h>
 #include <Threads.h>
 
 /* ------------------------------------------------------------------ */
 /* telnet protocol constants                                          */
 /* ------------------------------------------------------------------ */
 
-#define TEL_SE    240
-#define TEL_NOP   241
-#define TEL_BRK   243
-#define TEL_SB    250
-#define TEL_WILL  251
-#define TEL_WONT  252
-#define TEL_DO    253
-#define TEL_DONT  254
-#define TEL_IAC   255
-
 #define TELOPT_ECHO    1
 #define TELOPT_SGA     3
 #define TELOPT_TTYPE  24
 #define TELOPT_NAWS   31
-
-/* IAC parser states */
-#define TS_DATA    0
-#define TS_IAC     1
-#define TS_WILL    2
-#define TS_WONT    3
-#define TS_DO      4
-#define TS_DONT    5
-#define TS_SB      6
-#define TS_SB_IAC  7
+#define TELOPT_COMPRESS2 86  /* MCCP2 */
 
 /* ------------------------------------------------------------------ */
 /* raw TCP write                                                      */
 /* ------------------------------------------------------------------ */
 
-void tcp_write_s(int session_idx, char* buf, size_t len)
+/* one OTSnd for the outbound queue: bytes taken, 0 on flow control,
+   -1 on error */
+int tcp_send_some(int session_idx, const char* buf, size_t len)
 {
 	struct session* s = &sessions[session_idx];
+	OTResult r = OTSnd(s->endpoint, (void*)buf, len, 0);
 
-	if (s->thread_state == OPEN && s->thread_command != EXIT)
-	{
-		OTResult r = OTSnd(s->endpoint, buf, len, 0);
+	if (r == kOTFlowErr)
+		return 0;  /* flow control, T_GODATA wakes the thread */
 
-		if (r == kOTFlowErr)
-			return;  /* flow control, not fatal */
-
-		if (r == kOTLookErr)
-		{
-			/* pending event — let the read thread handle it */
-			return;
-		}
+	if (r == kOTLookErr)
+	{
+		/* pending event — let the read thread handle it */
+		return 0;
+	}
 
-		if (r < 0)
-		{
-			printf_s(session_idx, "\r\nTCP send error %d, closing.\r\n", (int)r);
-			s->thread_command = EXIT;
-		}
+	if (r < 0)
+	{
+		printf_s(session_idx, "\r\nTCP send error %d, closing.\r\n", (int)r);
+		s->thread_command = EXIT;
+		return -1;
 	}
+
+	return (int)r;
 }
 
 /* vterm output callback for telnet/nc sessions */
 void tcp_output_callback(const char *s, size_t len, void *user)
 {
 	int idx = (int)(intptr_t)user;
-	tcp_write_s(idx, (char*)s, len);
+	session_send(idx, s, len);
 }
 
 /* ------------------------------------------------------------------ */
@@ -89,16 +76,58 @@ unsigned long tcp_connect_deadline = 0;
 EndpointRef tcp_connect_ep = kOTInvalidEndpointRef;
 int tcp_connect_session_idx = -1;
 
+/* session threads sleep (stopped) while their endpoint is idle and the
+   notifier readies them again.  both handles are grabbed at thread time
+   the first time a thread goes to sleep. */
+static ThreadTaskRef tcp_task_ref = NULL;
+static ProcessSerialNumber tcp_psn;
+static int tcp_psn_valid = 0;
+
+/* interrupt-safe: flag the session and wake its thread and the app */
+void tcp_signal(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+
+	s->net_ready = 1;
+	if (s->net_sleeping && tcp_task_ref != NULL)
+		SetThreadReadyGivenTaskRef(tcp_task_ref, s->thread_id);
+	if (tcp_psn_valid)
+		WakeUpProcess(&tcp_psn);
+}
+
 /* OT notifier: yields to cooperative threads during blocking calls.
    Called at system task time with kOTSyncIdleEvent when
    OTUseSyncIdleEvents is true, keeping the machine responsive.
-   Also cancels on timeout or when disconnect sets thread_command=EXIT. */
+   Also cancels on timeout or when disconnect sets thread_command=EXIT.
+   When installed with context = session index + 1 it also wakes that
+   session's thread on incoming data and disconnects. */
 pascal void tcp_ot_notifier(void* context, OTEventCode event,
                                    OTResult result, void* cookie)
 {
-	(void)context;
+	int session_idx = (int)(intptr_t)context - 1;
+
 	(void)result;
 	(void)cookie;
+
+	switch (event)
+	{
+		case T_DATA:
+		case T_EXDATA:
+		case T_CONNECT:
+		case T_DISCONNECT:
+		case T_RESET:
+		case T_ORDREL:
+		case T_GODATA:
+		case T_GOEXDATA:
+		case kOTProviderWillClose:
+		case kOTProviderIsClosed:
+			if (session_idx >= 0 && session_idx < MAX_SESSIONS)
+				tcp_signal(session_idx);
+			return;
+		default:
+			break;
+	}
+
 	if (event == kOTSyncIdleEvent)
 	{
 		YieldToAnyThread();
@@ -122,12 +151,81 @@ pascal void tcp_ot_notifier(void* context, OTEventCode event,
 	}
 }
 
-static int tcp_init_connection(int session_idx, char* hostname)
+/* Park the calling session thread until its endpoint has data or a
+   disconnect, or someone asks it to exit. Anything other than the
+   session's own thread (e.g. the main event loop writing a keystroke)
+   just yields. The notifier may fire between the net_ready check and
+   the stop; tcp_wake_sleepers() in the event loop picks that up. */
+void tcp_wait_readable(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+	ThreadID current = kNoThreadID;
+
+	if (tcp_task_ref == NULL)
+		GetThreadCurrentTaskRef(&tcp_task_ref);
+	if (!tcp_psn_valid && GetCurrentProcess(&tcp_psn) == noErr)
+		tcp_psn_valid = 1;
+
+	if (MacGetCurrentThread(&current) != noErr || current != s->thread_id ||
+	    s->net_ready || s->thread_command != READ)
+	{
+		YieldToAnyThread();
+		return;
+	}
+
+	s->net_sleeping = 1;
+	SetThreadState(kCurrentThreadID, kStoppedThreadState, kNoThreadID);
+	s->net_sleeping = 0;
+}
+
+/* ready a sleeping session thread (after setting EXIT, queuing output...) */
+void tcp_wake(int session_idx)
+{
+	struct session* s = &sessions[session_idx];
+
+	s->net_ready = 1;
+	if (s->net_sleeping && s->thread_id != kNoThreadID)
+		SetThreadState(s->thread_id, kReadyThreadState, kNoThreadID);
+}
+
+/* event loop idle: catch wakeups that raced with a thread going to sleep */
+void tcp_wake_sleepers(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		struct session* s = &sessions[i];
+		if (!s->net_sleeping) continue;
+		if (s->net_ready || s->thread_command != READ ||
+		    session_has_output(i) ||
+		    (s->wake_at != 0 && (long)(TickCount() - s->wake_at) >= 0))
+			tcp_wake(i);
+	}
+}
+
+static int tcp_connect_endpoint(int session_idx, char* hostname)
 {
 	struct session* s = &sessions[session_idx];
 	OSStatus err = noErr;
 	TCall sndCall;
-	DNSAddress hostDNSAddress;
+	InetAddress hostAddress;
+
+	printf_s(session_idx, "Connecting to \"%s\"... ", hostname);
+	YieldToAnyThread();
+
+	/* resolve first (the cache makes repeat connects skip this); the
+	   lookup yields and gives up on timeout or disconnect */
+	err = dns_resolve_hostport(session_idx, hostname, &hostAddress);
+	if (err != noErr)
+	{
+		if (s->thread_command == EXIT)
+			printf_s(session_idx, "cancelled.\r\n");
+		else
+			printf_s(session_idx, "host not found (err=%d)\r\n", (int)err);
+		return 0;
+	}
+	conn_timing_mark(session_idx, PHASE_DNS);
 
 	s->endpoint = OTOpenEndpoint(OTCreateConfiguration(kTCPName), 0, nil, &err);
 	if (err != noErr || s->endpoint == kOTInvalidEndpointRef)
@@ -138,18 +236,16 @@ static int tcp_init_connection(int session_idx, char* hostname)
 
 	OT_CHECK(OTSetSynchronous(s->endpoint));
 	OT_CHECK(OTSetBlocking(s->endpoint));
-	OT_CHECK(OTInstallNotifier(s->endpoint, tcp_ot_notifier, nil));
+	OT_CHECK(OTInstallNotifier(s->endpoint, tcp_ot_notifier,
+	                           (void*)(intptr_t)(session_idx + 1)));
 	OT_CHECK(OTUseSyncIdleEvents(s->endpoint, true));
 	OT_CHECK(OTBind(s->endpoint, nil, nil));
 
 	OTMemzero(&sndCall, sizeof(TCall));
-	sndCall.addr.buf = (UInt8 *) &hostDNSAddress;
-	sndCall.addr.len = OTInitDNSAddress(&hostDNSAddress, hostname);
+	sndCall.addr.buf = (UInt8 *) &hostAddress;
+	sndCall.addr.len = sizeof(InetAddress);
 
-	printf_s(session_idx, "Connecting to \"%s\"... ", hostname);
-	YieldToAnyThread();
-
-	/* OTConnect blocks during DNS + TCP handshake.
+	/* OTConnect blocks during the TCP handshake.
 	   The idle notifier yields to other threads during the wait.
 	   A 30-second timeout prevents hanging on unreachable hosts. */
 	tcp_connect_ep = s->endpoint;
@@ -167,7 +263,10 @@ static int tcp_init_connection(int session_idx, char* hostname)
 		if (s->thread_command == EXIT)
 			printf_s(session_idx, "cancelled.\r\n");
 		else
+		{
 			printf_s(session_idx, "timed out.\r\n");
+			dns_connect_failed(hostname);
+		}
 		OTUnbind(s->endpoint);
 		OTCloseProvider(s->endpoint);
 		s->endpoint = kOTInvalidEndpointRef;
@@ -196,6 +295,7 @@ static int tcp_init_connection(int session_idx, char* hostname)
 	if (err != noErr)
 	{
 		printf_s(session_idx, "failed (err=%d)\r\n", (int)err);
+		dns_connect_failed(hostname);
 		OTUnbind(s->endpoint);
 		OTCloseProvider(s->endpoint);
 		s->endpoint = kOTInvalidEndpointRef;
@@ -213,6 +313,19 @@ static int tcp_init_connection(int session_idx, char* hostname)
 	return 1;
 }
 
+static int tcp_init_connection(int session_idx, char* hostname)
+{
+	int ok;
+
+	conn_timing_begin(session_idx,
+		sessions[session_idx].type == SESSION_TELNET ? "telnet" : "nc", hostname);
+	ok = tcp_connect_endpoint(session_idx, hostname);
+	if (ok) conn_timing_mark(session_idx, PHASE_TCP);
+	conn_timing_end(session_idx, ok);
+
+	return ok;
+}
+
 static void tcp_end_connection(int session_idx)
 {
 	struct session* s = &sessions[session_idx];
@@ -346,12 +459,13 @@ void telnet_send_naws(int session_idx)
 		OTSnd(s->endpoint, buf, 9, 0);
 }
 
-static void telnet_handle_will(int session_idx, unsigned char opt)
+void telnet_handle_will(int session_idx, unsigned char opt)
 {
 	switch (opt)
 	{
 		case TELOPT_ECHO:
 		case TELOPT_SGA:
+		case TELOPT_COMPRESS2:
 			telnet_send_cmd(session_idx, TEL_DO, opt);
 			break;
 		default:
@@ -360,7 +474,7 @@ static void telnet_handle_will(int session_idx, unsigned char opt)
 	}
 }
 
-static void telnet_handle_do(int session_idx, unsigned char opt)
+void telnet_handle_do(int session_idx, unsigned char opt)
 {
 	switch (opt)
 	{
@@ -378,8 +492,31 @@ static void telnet_handle_do(int session_idx, unsigned char opt)
 	}
 }
 
-static void telnet_handle_sb(int session_idx, unsigned char* buf, int len)
+static const struct filter_stage telnet_mccp;
+static const struct filter_stage telnet_drop;
+
+/* when the server starts MCCP2, everything after this IAC SE is
+   compressed and goes through the inflater */
+const struct filter_stage* telnet_handle_sb(int session_idx,
+                                            const unsigned char* buf, int len)
 {
+	if (len >= 1 && buf[0] == TELOPT_COMPRESS2)
+	{
+		struct session* s = &sessions[session_idx];
+
+		if (s->mccp != NULL)
+			return NULL;
+
+		s->mccp = inflate_new(INFLATE_ZLIB);
+		if (s->mccp == NULL)
+		{
+			printf_s(session_idx, "\r\nNo memory for MCCP, disconnecting.\r\n");
+			s->thread_command = EXIT;
+			return &telnet_drop;
+		}
+		return &telnet_mccp;
+	}
+
 	/* terminal type subnegotiation: option=TTYPE, qualifier=SEND(1) */
 	if (len >= 2 && buf[0] == TELOPT_TTYPE && buf[1] == 1)
 	{
@@ -402,139 +539,83 @@ static void telnet_handle_sb(int session_idx, unsigned char* buf, int len)
 		if (s->endpoint != kOTInvalidEndpointRef)
 			OTSnd(s->endpoint, resp, ri, 0);
 	}
+
+	return NULL;
 }
 
-/* process received data through telnet IAC state machine.
- * strips IAC sequences, converts bare LF to CRLF,
- * returns clean data length in out buffer. */
-static int telnet_process(int session_idx, const unsigned char* in, int in_len,
-                          unsigned char* out)
+/* MCCP2: inflate ahead of the IAC parser while the server compresses.
+   When its stream ends, the rest of the read is plain telnet again. */
+static void mccp_filter(int session_idx, const char* buf, size_t len,
+                        const struct filter_stage* next)
 {
 	struct session* s = &sessions[session_idx];
-	int oi = 0;
-	int i;
-	int prev_cr = 0;
+	size_t used = 0;
+	int rc;
 
-	for (i = 0; i < in_len; i++)
+	if (s->mccp == NULL)
 	{
-		unsigned char c = in[i];
+		filter_emit(session_idx, next, buf, len);
+		return;
+	}
 
-		switch (s->telnet_state)
-		{
-			case TS_DATA:
-				if (c == TEL_IAC)
-					s->telnet_state = TS_IAC;
-				else if (c == '\n' && !prev_cr)
-				{
-					out[oi++] = '\r';
-					out[oi++] = '\n';
-				}
-				else
-					out[oi++] = c;
-				prev_cr = (c == '\r');
-				break;
-
-			case TS_IAC:
-				switch (c)
-				{
-					case TEL_IAC:
-						out[oi++] = 0xFF;
-						s->telnet_state = TS_DATA;
-						break;
-					case TEL_WILL:
-						s->telnet_state = TS_WILL;
-						break;
-					case TEL_WONT:
-						s->telnet_state = TS_WONT;
-						break;
-					case TEL_DO:
-						s->telnet_state = TS_DO;
-						break;
-					case TEL_DONT:
-						s->telnet_state = TS_DONT;
-						break;
-					case TEL_SB:
-						s->telnet_state = TS_SB;
-						s->telnet_sb_len = 0;
-						break;
-					default:
-						/* NOP, BRK, etc. — ignore */
-						s->telnet_state = TS_DATA;
-						break;
-				}
-				break;
-
-			case TS_WILL:
-				telnet_handle_will(session_idx, c);
-				s->telnet_state = TS_DATA;
-				break;
-
-			case TS_WONT:
-				/* acknowledge, nothing to do */
-				s->telnet_state = TS_DATA;
-				break;
-
-			case TS_DO:
-				telnet_handle_do(session_idx, c);
-				s->telnet_state = TS_DATA;
-				break;
-
-			case TS_DONT:
-				s->telnet_state = TS_DATA;
-				break;
-
-			case TS_SB:
-				if (c == TEL_IAC)
-					s->telnet_state = TS_SB_IAC;
-				else if (s->telnet_sb_len < (int)sizeof(s->telnet_sb_buf))
-					s->telnet_sb_buf[s->telnet_sb_len++] = c;
-				break;
-
-			case TS_SB_IAC:
-				if (c == TEL_SE)
-				{
-					telnet_handle_sb(session_idx, s->telnet_sb_buf,
-					                 s->telnet_sb_len);
-					s->telnet_state = TS_DATA;
-				}
-				else
-				{
-					/* not SE, put byte into SB buffer */
-					if (s->telnet_sb_len < (int)sizeof(s->telnet_sb_buf))
-						s->telnet_sb_buf[s->telnet_sb_len++] = c;
-					s->telnet_state = TS_SB;
-				}
-				break;
-		}
+	rc = inflate_feed(s->mccp, session_idx, buf, len, &used, next);
+	if (rc == INFLATE_MORE)
+		return;
+
+	if (rc == INFLATE_ERROR && s->thread_command != EXIT)
+	{
+		printf_s(session_idx, "\r\nMCCP: %s, disconnecting.\r\n",
+		         inflate_error(s->mccp));
+		s->thread_command = EXIT;
 	}
 
-	return oi;
+	inflate_free(s->mccp);
+	s->mccp = NULL;
+
+	if (rc == INFLATE_END && used < len)
+		filter_emit(session_idx, next, buf + used, len - used);
+}
+
+/* receive pipelines: network bytes -> ... -> terminal */
+static const struct filter_stage telnet_ansi = { ansi_sys_filter, &filter_vterm };
+static const struct filter_stage telnet_chain = { telnet_filter, &telnet_ansi };
+static const struct filter_stage telnet_mccp = { mccp_filter, &telnet_chain };
+
+/* what's left of a read once the session is going away */
+static void drop_sink(int session_idx, const char* buf, size_t len,
+                      const struct filter_stage* next)
+{
 }
 
+static const struct filter_stage telnet_drop = { drop_sink, NULL };
+
+static void nc_sink(int session_idx, const char* buf, size_t len,
+                    const struct filter_stage* next);
+static const struct filter_stage nc_out = { nc_sink, NULL };
+static const struct filter_stage nc_ansi = { ansi_sys_filter, &nc_out };
+static const struct filter_stage nc_chain = { crlf_filter, &nc_ansi };
+
 /* ------------------------------------------------------------------ */
 /* read functions                                                     */
 /* ------------------------------------------------------------------ */
 
-static int ansi_sys_fixup(int session_idx, const char* in, int len, char* out);
-
-static void telnet_read(int session_idx)
+static int telnet_read(int session_idx)
 {
 	struct session* s = &sessions[session_idx];
 	OTFlags ot_flags = 0;
 	OTResult rc;
-	unsigned char clean[SSH_BUFFER_SIZE];
-	char fixup[SSH_BUFFER_SIZE];
-	int clean_len, fixup_len;
 
-	/* read half-buffer so CRLF expansion fits in clean[] */
-	rc = OTRcv(s->endpoint, s->recv_buffer, SSH_BUFFER_SIZE / 2, &ot_flags);
+	/* clear before reading: a notification that lands after this
+	   point keeps the thread from sleeping past new data */
+	s->net_ready = 0;
+	rc = OTRcv(s->endpoint, s->recv_buffer, SSH_BUFFER_SIZE, &ot_flags);
 
-	if (rc == kOTNoDataErr) return;
+	if (rc == kOTNoDataErr) return 0;
 
 	if (rc == kOTLookErr)
 	{
 		tcp_check_events(session_idx);
-		return;
+		return 1;
 	}
 
 	if (rc <= 0)
@@ -544,123 +625,47 @@ static void telnet_read(int session_idx)
 			printf_s(session_idx, "\r\nConnection closed (rc=%d).\r\n", (int)rc);
 			s->thread_command = EXIT;
 		}
-		return;
+		return 1;
 	}
 
-	clean_len = telnet_process(session_idx, (unsigned char*)s->recv_buffer,
-	                           (int)rc, clean);
-
-	if (clean_len > 0)
-	{
-		fixup_len = ansi_sys_fixup(session_idx, (char*)clean, clean_len,
-		                           fixup);
-		vterm_input_write(s->vterm, fixup, fixup_len);
-	}
+	filter_emit(session_idx, &telnet_mccp, s->recv_buffer, (size_t)rc);
+	if (s->predict_len > 0 || s->predict_hold) predict_check(session_idx, 1);
+	return 1;
 }
 
-/* Translate ANSI.SYS escape sequences to DEC VT equivalents.
-   ESC[s (save cursor) -> ESC 7 (DECSC)
-   ESC[u (restore cursor) -> ESC 8 (DECRC)
-   vterm interprets ESC[s as DECSLRM (set left/right margins) which
-   breaks BBS ANSI art that uses ESC[s/u for cursor save/restore.
-   Uses per-session state to handle sequences split across TCP chunks.
-   Reads from in, writes to out. Returns output length. */
-static int ansi_sys_fixup(int session_idx, const char* in, int len,
-                          char* out)
+/* nc output goes to the redirect file (nc > file) and/or the terminal */
+static void nc_sink(int session_idx, const char* buf, size_t len,
+                    const struct filter_stage* next)
 {
 	struct session* s = &sessions[session_idx];
-	int ri = 0, wi = 0;
-
-	while (ri < len)
-	{
-		char c = in[ri];
-
-		switch (s->ansi_fixup_state)
-		{
-			case 0: /* normal */
-				if (c == '\033')
-					s->ansi_fixup_state = 1;
-				else
-					out[wi++] = c;
-				ri++;
-				break;
-
-			case 1: /* saw ESC */
-				if (c == '[')
-				{
-					s->ansi_fixup_state = 2;
-					ri++;
-				}
-				else
-				{
-					/* not ESC[, emit the ESC and reprocess this byte */
-					out[wi++] = '\033';
-					s->ansi_fixup_state = 0;
-				}
-				break;
-
-			case 2: /* saw ESC[ */
-				if (c == 's')
-				{
-					out[wi++] = '\033';
-					out[wi++] = '7';
-				}
-				else if (c == 'u')
-				{
-					out[wi++] = '\033';
-					out[wi++] = '8';
-				}
-				else
-				{
-					out[wi++] = '\033';
-					out[wi++] = '[';
-					out[wi++] = c;
-				}
-				s->ansi_fixup_state = 0;
-				ri++;
-				break;
-		}
-	}
 
-	return wi;
-}
-
-/* convert bare LF to CRLF for vterm display */
-static int lf_to_crlf(const char* in, int in_len, char* out)
-{
-	int oi = 0;
-	int i;
-	int prev_cr = 0;
-
-	for (i = 0; i < in_len; i++)
+	if (s->redir_refnum != 0)
 	{
-		if (in[i] == '\n' && !prev_cr)
-			out[oi++] = '\r';
-		out[oi++] = in[i];
-		prev_cr = (in[i] == '\r');
+		long count = (long)len;
+		FSWrite(s->redir_refnum, &count, buf);
 	}
 
-	return oi;
+	if (!s->redir_quiet)
+		vterm_sink(session_idx, buf, len, NULL);
 }
 
-static void nc_raw_read(int session_idx)
+static int nc_raw_read(int session_idx)
 {
 	struct session* s = &sessions[session_idx];
 	OTFlags ot_flags = 0;
 	OTResult rc;
-	char clean[SSH_BUFFER_SIZE];
-	char fixup[SSH_BUFFER_SIZE];
-	int clean_len, fixup_len;
 
-	/* read half-buffer so CRLF expansion fits in clean[] */
-	rc = OTRcv(s->endpoint, s->recv_buffer, SSH_BUFFER_SIZE / 2, &ot_flags);
+	/* clear before reading: a notification that lands after this
+	   point keeps the thread from sleeping past new data */
+	s->net_ready = 0;
+	rc = OTRcv(s->endpoint, s->recv_buffer, SSH_BUFFER_SIZE, &ot_flags);
 
-	if (rc == kOTNoDataErr) return;
+	if (rc == kOTNoDataErr) return 0;
 
 	if (rc == kOTLookErr)
 	{
 		tcp_check_events(session_idx);
-		return;
+		return 1;
 	}
 
 	if (rc <= 0)
@@ -670,21 +675,11 @@ static void nc_raw_read(int session_idx)
 			printf_s(session_idx, "\r\nConnection closed (rc=%d).\r\n", (int)rc);
 			s->thread_command = EXIT;
 		}
-		return;
+		return 1;
 	}
 
-	clean_len = lf_to_crlf(s->recv_buffer, (int)rc, clean);
-	fixup_len = ansi_sys_fixup(session_idx, clean, clean_len, fixup);
-
-	/* write to redirect file if active (nc > file) */
-	if (s->redir_refnum != 0)
-	{
-		long count = (long)fixup_len;
-		FSWrite(s->redir_refnum, &count, fixup);
-	}
-
-	if (!s->redir_quiet)
-		vterm_input_write(s->vterm, fixup, fixup_len);
+	filter_emit(session_idx, &nc_chain, s->recv_buffer, (size_t)rc);
+	return 1;
 }
 
 /* ------------------------------------------------------------------ */
@@ -747,15 +742,25 @@ static void* telnet_read_thread(void* arg)
 		EnableItem(menu, 5);
 	}
 
+	session_output_discard(session_idx);
+
 	while (s->thread_command == READ && s->thread_state == OPEN)
 	{
-		telnet_read(session_idx);
-		YieldToAnyThread();
+		int pending = session_flush_output(session_idx, 0);
+
+		if (telnet_read(session_idx) || (pending && !s->out_blocked))
+			YieldToAnyThread();
+		else
+			tcp_wait_readable(session_idx);
 	}
+	session_output_discard(session_idx);
 
 	if (s->thread_state != DONE)
 		tcp_end_connection(session_idx);
 
+	inflate_free(s->mccp);
+	s->mccp = NULL;
+
 	/* if disconnect gave up waiting for us, we own the buffers */
 	if (s->thread_command == EXIT)
 		tcp_free_buffers(s);
@@ -802,11 +807,18 @@ static void* nc_read_thread(void* arg)
 
 	s->thread_state = OPEN;
 
+	session_output_discard(session_idx);
+
 	while (s->thread_command == READ && s->thread_state == OPEN)
 	{
-		nc_raw_read(session_idx);
-		YieldToAnyThread();
+		int pending = session_flush_output(session_idx, 0);
+
+		if (nc_raw_read(session_idx) || (pending && !s->out_blocked))
+			YieldToAnyThread();
+		else
+			tcp_wait_readable(session_idx);
 	}
+	session_output_discard(session_idx);
 
 	if (s->thread_state != DONE)
 		tcp_end_connection(session_idx);
@@ -857,8 +869,10 @@ int telnet_connect(int session_idx)
 		return 0;
 	}
 
-	s->telnet_state = TS_DATA;
-	s->telnet_sb_len = 0;
+	s->iac.state = 0;
+	s->iac.sb_len = 0;
+	s->filter.crlf_prev_cr = 0;
+	s->filter.ansi_fixup = 0;
 	s->thread_command = WAIT;
 
 	err = NewThread(kCooperativeThread, telnet_read_thread,
@@ -902,6 +916,7 @@ void telnet_disconnect(int session_idx)
 	struct window_context* wc = window_for_session(session_idx);
 
 	s->thread_command = EXIT;
+	tcp_wake(session_idx);
 
 	if (s->thread_state != UNINITIALIZED && s->thread_state != DONE)
 	{
@@ -998,6 +1013,8 @@ int nc_inline_connect(int session_idx)
 		return 0;
 	}
 
+	s->filter.crlf_prev_cr = 0;
+	s->filter.ansi_fixup = 0;
 	s->thread_command = WAIT;
 
 	err = NewThread(kCooperativeThread, nc_read_thread,
@@ -1022,6 +1039,7 @@ void nc_inline_disconnect(int session_idx)
 	struct session* s = &sessions[session_idx];
 
 	s->thread_command = EXIT;
+	tcp_wake(session_idx);
 
 	if (s->thread_state != UNINITIALIZED && s->thread_state != DONE)
 	{
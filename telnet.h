@@ -6,12 +6,16 @@
 
 #include <stddef.h>
 
-void tcp_write_s(int session_idx, char* buf, size_t len);
+int tcp_send_some(int session_idx, const char* buf, size_t len);
 pascal void tcp_ot_notifier(void* context, OTEventCode event,
                             OTResult result, void* cookie);
 extern unsigned long tcp_connect_deadline;
 extern EndpointRef tcp_connect_ep;
 extern int tcp_connect_session_idx;
+void tcp_signal(int session_idx);
+void tcp_wait_readable(int session_idx);
+void tcp_wake(int session_idx);
+void tcp_wake_sleepers(void);
 int telnet_connect(int session_idx);
 void telnet_disconnect(int session_idx);
 int nc_inline_connect(int session_idx);
@@ -0,0 +1,195 @@
+/*
+ * Runs bench.c (sshbench) on a Unix host, for numbers to set the Mac
+ * ones against. The crypto timings call mbedtls directly (2.28 or 3.x;
+ * what they use is in both) and the handshakes go through libssh2.
+ * With the distribution's -dev packages:
+ *
+ *   cc -O2 -I. -Itools/host -o bench_host tools/bench_host.c bench.c \
+ *      -lmbedcrypto -lssh2
+ *   ./bench_host [sym|kex|all]
+ *   python3 tools/ssh_test_server.py 2222 &
+ *   ./bench_host 127.0.0.1:2222 [rounds]
+ *
+ * A packaged libssh2 is usually built on OpenSSL, so its handshake
+ * times say more about the server than about the Mac's crypto; link a
+ * libssh2 built with CRYPTO_BACKEND=mbedTLS to compare like with like.
+ *
+ * tools/host/ stands in for the three Toolbox headers bench.c and
+ * console.h pull in. Microseconds() reads the monotonic clock and the
+ * yield does nothing. Ciphers and MACs come out in MB/s on anything
+ * this fast. Handshakes are key exchange only, with libssh2's own
+ * algorithm order (the app's profiles live in net.c); Ctrl+C stops
+ * either.
+ */
+
+#include "bench.h"
+
+#include <Threads.h>
+#include <Timer.h>
+
+#include <libssh2.h>
+
+#include <netdb.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t cancelled;
+
+static void on_sigint(int sig)
+{
+	cancelled = 1;
+}
+
+void Microseconds(UnsignedWide* t)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t->hi = 0;
+	t->lo = (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+OSErr YieldToAnyThread(void)
+{
+	return 0;
+}
+
+/* the terminal gets \r\n, stdout just \n */
+void printf_s(int session_idx, const char* c, ...)
+{
+	char buf[1024];
+	va_list args;
+	char* p;
+
+	va_start(args, c);
+	vsnprintf(buf, sizeof(buf), c, args);
+	va_end(args);
+
+	for (p = buf; *p; p++)
+		if (*p != '\r')
+			putchar(*p);
+	fflush(stdout);
+}
+
+int bench_cancelled(int idx)
+{
+	return cancelled;
+}
+
+const char* bench_profile(int profile)
+{
+	return profile == 0 ? "default" : NULL;
+}
+
+static int tcp_connect(const char* hostport)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char* port = "22";
+	char* colon;
+	int fd = -1;
+
+	snprintf(host, sizeof(host), "%s", hostport);
+	colon = strrchr(host, ':');
+	if (colon)
+	{
+		*colon = '\0';
+		port = colon + 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+
+	for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* same as the app: the time is for libssh2_session_handshake alone */
+long bench_connect(int idx, const char* hostport, int profile,
+                   char* algos, int algos_size)
+{
+	LIBSSH2_SESSION* session;
+	UnsignedWide start, end;
+	long ms = -1;
+	int fd;
+
+	fd = tcp_connect(hostport);
+	if (fd < 0)
+	{
+		printf_s(idx, "cannot connect to %s\r\n", hostport);
+		return -1;
+	}
+
+	session = libssh2_session_init();
+	if (session != NULL)
+	{
+		Microseconds(&start);
+		if (libssh2_session_handshake(session, fd) == 0)
+		{
+			Microseconds(&end);
+			ms = (long)((end.lo - start.lo) / 1000);
+			snprintf(algos, algos_size, "%s %s %s %s",
+			         libssh2_session_methods(session, LIBSSH2_METHOD_KEX),
+			         libssh2_session_methods(session, LIBSSH2_METHOD_HOSTKEY),
+			         libssh2_session_methods(session, LIBSSH2_METHOD_CRYPT_SC),
+			         libssh2_session_methods(session, LIBSSH2_METHOD_MAC_SC));
+		}
+		libssh2_session_disconnect(session, "bench done");
+		libssh2_session_free(session);
+	}
+
+	close(fd);
+	return ms;
+}
+
+int main(int argc, char** argv)
+{
+	const char* what = argc > 1 ? argv[1] : "";
+
+	signal(SIGINT, on_sigint);
+
+	if (strcmp(what, "-h") == 0 || argc > 3)
+	{
+		fprintf(stderr, "usage: bench_host [sym|kex|all]\n"
+		                "       bench_host <host>[:port] [rounds]\n");
+		return 2;
+	}
+
+	if (strcmp(what, "sym") == 0)
+		bench_crypto(0, BENCH_SYM);
+	else if (strcmp(what, "kex") == 0)
+		bench_crypto(0, BENCH_KEX);
+	else if (strcmp(what, "all") == 0)
+		bench_crypto(0, BENCH_SYM | BENCH_KEX | BENCH_KEX_BIG);
+	else if (what[0] == '\0')
+		bench_crypto(0, BENCH_SYM | BENCH_KEX);
+	else
+	{
+		if (libssh2_init(0) != 0)
+			return 1;
+		printf_s(0, "Timing handshakes with %s (no login):\r\n", what);
+		bench_handshake(0, what, -1, argc > 2 ? atoi(argv[2]) : 3);
+		libssh2_exit();
+	}
+
+	return cancelled;
+}
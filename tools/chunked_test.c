@@ -0,0 +1,178 @@
+/*
+ * Host-side check of chunked.c and gzip inflate.c against
+ * tools/http_test_server.py.
+ *
+ *   cc -I. -o chunked_test tools/chunked_test.c chunked.c inflate.c
+ *   python3 tools/http_test_server.py 8080 &
+ *   ./chunked_test 8080
+ *
+ * Fetches /chunked/N and /gzip-chunked/N for a range of sizes over one
+ * kept-alive connection, feeding the decoders in random sized pieces,
+ * and checks the output against the server's pattern. Ending exactly
+ * at the last chunk is what lets the next response on the connection
+ * parse.
+ */
+
+#include "chunked.h"
+#include "inflate.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static unsigned char* out;
+static size_t out_len, out_cap;
+
+static void collect(int session_idx, const char* buf, size_t len,
+                    const struct filter_stage* next)
+{
+	if (out_len + len > out_cap)
+	{
+		out_cap = (out_len + len) * 2;
+		out = realloc(out, out_cap);
+	}
+	memcpy(out + out_len, buf, len);
+	out_len += len;
+}
+
+static const struct filter_stage collect_stage = { collect, NULL };
+
+/* gzip bodies: chunked -> gunzip -> collect, as in wget */
+static struct inflater* gz;
+static int gz_rc;
+
+static void gunzip(int session_idx, const char* buf, size_t len,
+                   const struct filter_stage* next)
+{
+	size_t used;
+
+	if (gz_rc == INFLATE_MORE)
+		gz_rc = inflate_feed(gz, session_idx, buf, len, &used, next);
+}
+
+static const struct filter_stage gunzip_stage = { gunzip, &collect_stage };
+
+/* same bytes as pattern() in the server */
+static int pattern_ok(size_t n)
+{
+	size_t i;
+
+	if (out_len != n) return 0;
+	for (i = 0; i < n; i++)
+		if (out[i] != (unsigned char)((i * 31 + (i >> 8)) & 0xff)) return 0;
+	return 1;
+}
+
+/* headers one byte at a time, so no body bytes are read with them */
+static int read_headers(int fd)
+{
+	char c;
+	int state = 0;
+
+	while (state < 4 && read(fd, &c, 1) == 1)
+	{
+		if ((state % 2 == 0 && c == '\r') || (state % 2 == 1 && c == '\n'))
+			state++;
+		else
+			state = (c == '\r') ? 1 : 0;
+	}
+	return state == 4;
+}
+
+/* GET path and decode its chunked body into stage; returns the
+   chunked_feed result */
+static int fetch(int fd, const char* path, const struct filter_stage* stage,
+                 int* leftover)
+{
+	char req[256];
+	char buf[32768];
+	struct chunked d;
+	int r = CHUNKED_MORE;
+
+	snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: test\r\n%s\r\n", path,
+	         stage == &gunzip_stage ? "Accept-Encoding: gzip\r\n" : "");
+	if (write(fd, req, strlen(req)) < 0 || !read_headers(fd))
+		return CHUNKED_ERROR;
+
+	chunked_init(&d);
+	out_len = 0;
+	*leftover = 0;
+
+	while (r == CHUNKED_MORE)
+	{
+		ssize_t n = read(fd, buf, sizeof(buf));
+		size_t pos = 0;
+
+		if (n <= 0) return CHUNKED_ERROR;
+
+		/* random splits, down to single bytes */
+		while (pos < (size_t)n && r == CHUNKED_MORE)
+		{
+			size_t piece = 1 + rand() % (rand() % 2 ? 8 : 20000);
+			size_t used;
+
+			if (piece > n - pos) piece = n - pos;
+			r = chunked_feed(&d, 0, buf + pos, piece, &used, stage);
+			pos += used;
+			if (r == CHUNKED_MORE && used != piece) return CHUNKED_ERROR;
+		}
+		*leftover += n - pos;
+	}
+	return r;
+}
+
+int main(int argc, char** argv)
+{
+	static const size_t sizes[] = { 0, 1, 2, 100, 5000, 40000, 100000, 300000 };
+	struct sockaddr_in sa;
+	char path[64];
+	int fd, leftover, r;
+	int failures = 0;
+	size_t i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(argc > 1 ? atoi(argv[1]) : 8080);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+	{
+		perror("connect");
+		return 2;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		int ok;
+
+		snprintf(path, sizeof(path), "/chunked/%lu", (unsigned long)sizes[i]);
+		r = fetch(fd, path, &collect_stage, &leftover);
+		ok = r == CHUNKED_END && leftover == 0 && pattern_ok(sizes[i]);
+		printf("%-24s %s\n", path, ok ? "ok" : "FAIL");
+		failures += !ok;
+
+		snprintf(path, sizeof(path), "/gzip-chunked/%lu", (unsigned long)sizes[i]);
+		gz = inflate_new(INFLATE_GZIP);
+		gz_rc = INFLATE_MORE;
+		r = fetch(fd, path, &gunzip_stage, &leftover);
+		ok = r == CHUNKED_END && gz_rc == INFLATE_END && leftover == 0 &&
+		     pattern_ok(sizes[i]);
+		printf("%-24s %s\n", path, ok ? "ok" : "FAIL");
+		failures += !ok;
+		inflate_free(gz);
+	}
+
+	/* malformed framing must be caught, not written out */
+	r = fetch(fd, "/bad-chunked", &collect_stage, &leftover);
+	printf("%-24s %s\n", "/bad-chunked", r == CHUNKED_ERROR ? "ok" : "FAIL");
+	failures += r != CHUNKED_ERROR;
+
+	close(fd);
+	free(out);
+	return failures != 0;
+}
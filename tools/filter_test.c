@@ -0,0 +1,239 @@
+/*
+ * Host-side check of the receive filters in filter.c.
+ *
+ *   cc -I. -o filter_test tools/filter_test.c filter.c
+ *   ./filter_test [seed]
+ *
+ * ESC[s and ESC[u are cut at every byte boundary, a lone ESC (or ESC[)
+ * at the end of a read must wait for the next one, and random input in
+ * random pieces must come out of ansi_sys_filter exactly as the old
+ * copying ansi_sys_fixup made it from the whole buffer. crlf_filter is
+ * held to the same: its output can't depend on where the reads split.
+ */
+
+#include "filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* one session's worth of state, as sessions[] keeps on the Mac */
+static struct filter_state state;
+
+struct filter_state* filter_state(int session_idx)
+{
+	return &state;
+}
+
+static char out[4096];
+static size_t out_len;
+
+static void collect(int session_idx, const char* buf, size_t len,
+                    const struct filter_stage* next)
+{
+	if (out_len + len > sizeof(out))
+	{
+		fprintf(stderr, "output overflow\n");
+		exit(2);
+	}
+	memcpy(out + out_len, buf, len);
+	out_len += len;
+}
+
+static const struct filter_stage collect_stage = { collect, NULL };
+
+/* ansi_sys_fixup as it was before the filters, state passed in */
+static int ref_fixup(unsigned char* fixup_state, const char* in, int len, char* dst)
+{
+	int ri = 0, wi = 0;
+
+	while (ri < len)
+	{
+		char c = in[ri];
+
+		switch (*fixup_state)
+		{
+			case 0:
+				if (c == '\033')
+					*fixup_state = 1;
+				else
+					dst[wi++] = c;
+				ri++;
+				break;
+
+			case 1:
+				if (c == '[')
+				{
+					*fixup_state = 2;
+					ri++;
+				}
+				else
+				{
+					dst[wi++] = '\033';
+					*fixup_state = 0;
+				}
+				break;
+
+			case 2:
+				if (c == 's')
+				{
+					dst[wi++] = '\033';
+					dst[wi++] = '7';
+				}
+				else if (c == 'u')
+				{
+					dst[wi++] = '\033';
+					dst[wi++] = '8';
+				}
+				else
+				{
+					dst[wi++] = '\033';
+					dst[wi++] = '[';
+					dst[wi++] = c;
+				}
+				*fixup_state = 0;
+				ri++;
+				break;
+		}
+	}
+
+	return wi;
+}
+
+/* LF -> CRLF over the whole buffer, for crlf_filter to match */
+static int ref_crlf(const char* in, int len, char* dst)
+{
+	int prev_cr = 0;
+	int i, wi = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		if (in[i] == '\n' && !prev_cr)
+			dst[wi++] = '\r';
+		dst[wi++] = in[i];
+		prev_cr = (in[i] == '\r');
+	}
+
+	return wi;
+}
+
+/* run fn over in, cut at the cuts[] offsets (ascending) */
+static void run_split(filter_fn fn, const char* in, size_t len,
+                      const size_t* cuts, int ncuts)
+{
+	size_t pos = 0;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	out_len = 0;
+
+	for (i = 0; i <= ncuts; i++)
+	{
+		size_t stop = (i < ncuts) ? cuts[i] : len;
+
+		fn(0, in + pos, stop - pos, &collect_stage);
+		pos = stop;
+	}
+}
+
+static int same(const char* want, size_t want_len)
+{
+	return out_len == want_len && memcmp(out, want, want_len) == 0;
+}
+
+static void show(const char* what, int ok, int* failures)
+{
+	printf("%-40s %s\n", what, ok ? "ok" : "FAIL");
+	*failures += !ok;
+}
+
+int main(int argc, char** argv)
+{
+	static const char save_restore[] = "ab\033[s cd\033[u ef\033[1mgh";
+	static const char save_restore_want[] = "ab\0337 cd\0338 ef\033[1mgh";
+	static const char alphabet[] = "\033\033\033[[su1m;\r\n\nx";
+	char in[256];
+	char want[1024];
+	size_t cuts[256];
+	size_t len = sizeof(save_restore) - 1;
+	size_t i, j;
+	unsigned seed = (argc > 1) ? (unsigned)atoi(argv[1]) : 1;
+	int failures = 0;
+	int ok;
+	int n;
+
+	/* one cut anywhere, then two cuts anywhere */
+	ok = 1;
+	for (i = 0; i <= len; i++)
+	{
+		cuts[0] = i;
+		run_split(ansi_sys_filter, save_restore, len, cuts, 1);
+		ok &= same(save_restore_want, sizeof(save_restore_want) - 1);
+
+		for (j = i; j <= len; j++)
+		{
+			cuts[1] = j;
+			run_split(ansi_sys_filter, save_restore, len, cuts, 2);
+			ok &= same(save_restore_want, sizeof(save_restore_want) - 1);
+		}
+	}
+	show("ESC[s / ESC[u split at every boundary", ok, &failures);
+
+	/* a byte per read */
+	for (i = 0; i < len; i++)
+		cuts[i] = i + 1;
+	run_split(ansi_sys_filter, save_restore, len, cuts, (int)len - 1);
+	show("ESC[s / ESC[u a byte at a time",
+	     same(save_restore_want, sizeof(save_restore_want) - 1), &failures);
+
+	/* a lone ESC at the end of a read is held, not dropped or doubled */
+	run_split(ansi_sys_filter, "abc\033", 4, NULL, 0);
+	ok = same("abc", 3) && state.ansi_fixup == 1;
+	ansi_sys_filter(0, "x", 1, &collect_stage);
+	ok &= same("abc\033x", 5) && state.ansi_fixup == 0;
+	show("trailing ESC, then plain text", ok, &failures);
+
+	run_split(ansi_sys_filter, "abc\033", 4, NULL, 0);
+	ansi_sys_filter(0, "[s", 2, &collect_stage);
+	show("trailing ESC, then [s", same("abc\0337", 5) && state.ansi_fixup == 0,
+	     &failures);
+
+	run_split(ansi_sys_filter, "abc\033[", 5, NULL, 0);
+	ok = same("abc", 3) && state.ansi_fixup == 2;
+	ansi_sys_filter(0, "1m", 2, &collect_stage);
+	ok &= same("abc\033[1m", 7);
+	show("trailing ESC[, then 1m", ok, &failures);
+
+	/* random input in random pieces against the old fixup */
+	srand(seed);
+	ok = 1;
+	for (n = 0; n < 200000 && ok; n++)
+	{
+		size_t in_len = rand() % sizeof(in);
+		unsigned char ref_state = 0;
+		int ncuts = 0;
+		int want_len;
+
+		for (i = 0; i < in_len; i++)
+			in[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		for (i = 1; i < in_len; i++)
+			if (rand() % 4 == 0)
+				cuts[ncuts++] = i;
+
+		want_len = ref_fixup(&ref_state, in, (int)in_len, want);
+		run_split(ansi_sys_filter, in, in_len, cuts, ncuts);
+		ok = same(want, want_len) && state.ansi_fixup == ref_state;
+
+		if (ok)
+		{
+			want_len = ref_crlf(in, (int)in_len, want);
+			run_split(crlf_filter, in, in_len, cuts, ncuts);
+			ok = same(want, want_len);
+		}
+	}
+	if (!ok)
+		printf("seed %u case %d differs\n", seed, n - 1);
+	show("random pieces match the old fixup", ok, &failures);
+
+	return failures != 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for the Toolbox types bench.c and console.h see, for
+ * tools/bench_host.c. Only what those two need.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef short OSErr;
+typedef unsigned int UInt32;
+
+typedef struct { short top, left, bottom, right; } Rect;
+typedef struct { short v, h; } Point;
+
+/* lo is a whole unsigned long here, so a 64 bit host never wraps */
+typedef struct { unsigned long hi, lo; } UnsignedWide;
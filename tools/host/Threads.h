@@ -0,0 +1,9 @@
+/*
+ * Host stand-in for Threads.h, for tools/bench_host.c.
+ */
+
+#pragma once
+
+#include "MacTypes.h"
+
+OSErr YieldToAnyThread(void);
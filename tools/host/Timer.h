@@ -0,0 +1,9 @@
+/*
+ * Host stand-in for Timer.h, for tools/bench_host.c.
+ */
+
+#pragma once
+
+#include "MacTypes.h"
+
+void Microseconds(UnsignedWide* t);
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""Minimal HTTP/1.1 test server for wget.
+Usage: python3 http_test_server.py [port]
+From Mac QEMU: wget http://10.0.2.2:<port>/chunked/100000
+(10.0.2.2 is the QEMU SLIRP host gateway)
+
+Paths (N = body size in bytes, content from pattern() below):
+  /file/N      Content-Length body, honours Range: bytes=M-
+  /drop/N      like /file/N, but the connection is cut after 40% of N
+               (so a resumed fetch gets a bit further each time)
+  /stall/N     like /drop/N, but goes quiet instead, for client timeouts
+  /chunked/N   chunked body, odd chunk sizes, extensions and a trailer,
+               written in small pieces so framing splits across reads
+  /close/N     no length, connection closed after the body
+  /redirect/N  302 to /file/N
+  /bad-chunked malformed chunk size line
+  /gzip/N      Content-Encoding: gzip with a length, if the client
+               sent Accept-Encoding: gzip (plain /file/N otherwise)
+  /gzip-chunked/N  the same, chunked
+Connections are kept alive unless the client asks otherwise.
+
+Checking resume, on the Mac or with any client on Linux:
+  until wget -c http://127.0.0.1:8080/drop/1000000; do :; done
+"""
+import gzip, socket, sys, time, threading
+
+PORT = int(sys.argv[1]) if len(sys.argv) > 1 else 8080
+
+# chunk sizes cycled through for /chunked
+CHUNK_SIZES = [1, 2, 17, 1000, 4096, 40000, 3]
+
+
+def pattern(n):
+    """body bytes for size n; tools/chunked_test.c makes the same"""
+    return bytes((i * 31 + (i >> 8)) & 0xff for i in range(n))
+
+
+def send_split(conn, data):
+    """send in awkward pieces so the client sees framing cut anywhere"""
+    cut = max(1, len(data) // 3)
+    for i in range(0, len(data), cut):
+        conn.sendall(data[i:i + cut])
+        time.sleep(0.002)
+
+
+def send_chunked(conn, body):
+    pos = 0
+    k = 0
+    while pos < len(body):
+        size = CHUNK_SIZES[k % len(CHUNK_SIZES)]
+        piece = body[pos:pos + size]
+        ext = b";piece=%d" % k if k % 3 == 1 else b""
+        send_split(conn, b"%x%s\r\n" % (len(piece), ext))
+        conn.sendall(piece)
+        send_split(conn, b"\r\n")
+        pos += size
+        k += 1
+    send_split(conn, b"0\r\nX-Test-Trailer: done\r\n\r\n")
+
+
+def send_file(conn, n, headers, conn_hdr, cut):
+    """Content-Length body with Range support; with cut, stop after
+    that many body bytes and return False so the caller hangs up"""
+    body = pattern(n)
+    start = 0
+    rng = headers.get("range", "")
+    if rng.startswith("bytes=") and rng[6:].split("-")[0].isdigit():
+        start = int(rng[6:].split("-")[0])
+        if start >= n:
+            conn.sendall(b"HTTP/1.1 416 Range Not Satisfiable\r\n"
+                         b"Content-Range: bytes */%d\r\nContent-Length: 0\r\n%s\r\n"
+                         % (n, conn_hdr))
+            return True
+        head = b"HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %d-%d/%d\r\n" \
+            % (start, n - 1, n)
+    else:
+        head = b"HTTP/1.1 200 OK\r\n"
+    part = body[start:]
+    conn.sendall(head + b"Content-Length: %d\r\n%s\r\n" % (len(part), conn_hdr))
+    if cut is not None and len(part) > cut:
+        conn.sendall(part[:cut])
+        print(f"  cut off at {start + cut} of {n}")
+        return False
+    conn.sendall(part)
+    return True
+
+
+def read_request(conn, buf):
+    while b"\r\n\r\n" not in buf:
+        data = conn.recv(4096)
+        if not data:
+            return None, b""
+        buf += data
+    head, rest = buf.split(b"\r\n\r\n", 1)
+    return head.decode("latin-1"), rest
+
+
+def handle(conn, addr):
+    conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    buf = b""
+    try:
+        while True:
+            head, buf = read_request(conn, buf)
+            if head is None:
+                print(f"{addr}: closed")
+                return
+            lines = head.split("\r\n")
+            method, path, version = lines[0].split(" ", 2)
+            headers = {}
+            for line in lines[1:]:
+                name, _, value = line.partition(":")
+                headers[name.strip().lower()] = value.strip().lower()
+            print(f"{addr}: {method} {path} {version}")
+
+            keep = version == "HTTP/1.1" and headers.get("connection") != "close"
+            conn_hdr = b"" if keep else b"Connection: close\r\n"
+            parts = path.strip("/").split("/")
+            n = int(parts[1]) if len(parts) > 1 and parts[1].isdigit() else 0
+
+            if parts[0] == "file":
+                send_file(conn, n, headers, conn_hdr, None)
+            elif parts[0] == "drop":
+                if not send_file(conn, n, headers, conn_hdr, max(1, n * 2 // 5)):
+                    return
+            elif parts[0] == "stall":
+                if not send_file(conn, n, headers, conn_hdr, max(1, n * 2 // 5)):
+                    time.sleep(120)
+                    return
+            elif parts[0] in ("gzip", "gzip-chunked") and \
+                    "gzip" in headers.get("accept-encoding", ""):
+                body = gzip.compress(pattern(n))
+                if parts[0] == "gzip":
+                    conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+                                 b"Content-Length: %d\r\n%s\r\n" % (len(body), conn_hdr) + body)
+                else:
+                    send_split(conn, b"HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+                               b"Transfer-Encoding: chunked\r\n%s\r\n" % conn_hdr)
+                    send_chunked(conn, body)
+            elif parts[0] in ("gzip", "gzip-chunked"):
+                send_file(conn, n, headers, conn_hdr, None)
+            elif parts[0] == "chunked":
+                send_split(conn, b"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n%s\r\n"
+                           % conn_hdr)
+                send_chunked(conn, pattern(n))
+            elif parts[0] == "close":
+                conn.sendall(b"HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n" + pattern(n))
+                keep = False
+            elif parts[0] == "redirect":
+                conn.sendall(b"HTTP/1.1 302 Found\r\nLocation: /file/%d\r\n"
+                             b"Content-Length: 0\r\n%s\r\n" % (n, conn_hdr))
+            elif parts[0] == "bad-chunked":
+                conn.sendall(b"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n"
+                             b"Connection: close\r\n\r\n5\r\nhello\r\nzz\r\n")
+                keep = False
+            else:
+                conn.sendall(b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n"
+                             % conn_hdr)
+
+            if not keep:
+                return
+    except (ConnectionError, ValueError) as e:
+        print(f"{addr}: {e}")
+    finally:
+        conn.close()
+
+
+srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+srv.bind(("0.0.0.0", PORT))
+srv.listen(4)
+print(f"HTTP test server on port {PORT}")
+print(f"From Mac QEMU: wget http://10.0.2.2:{PORT}/chunked/100000")
+
+while True:
+    conn, addr = srv.accept()
+    threading.Thread(target=handle, args=(conn, addr), daemon=True).start()
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Throwaway SSH server for timing handshakes (needs paramiko).
+Usage: python3 ssh_test_server.py [port] [rsa|ecdsa] [kex,kex,...]
+From Mac QEMU: sshbench 10.0.2.2:<port> fast
+On Linux:      ./bench_host 127.0.0.1:<port>   (see tools/bench_host.c)
+(10.0.2.2 is the QEMU SLIRP host gateway)
+
+The host key is made fresh at startup. Key exchange runs to the end and
+every login is refused, which is all sshbench needs; each connection
+prints the host key and cipher agreed. A kex list limits the server to
+those, to time one method at a time, e.g. diffie-hellman-group14-sha256.
+"""
+import socket, sys, threading
+
+import paramiko
+
+PORT = int(sys.argv[1]) if len(sys.argv) > 1 else 2222
+KEY_TYPE = sys.argv[2] if len(sys.argv) > 2 else "rsa"
+KEX = sys.argv[3].split(",") if len(sys.argv) > 3 else None
+
+if KEY_TYPE == "rsa":
+    HOST_KEY = paramiko.RSAKey.generate(2048)
+elif KEY_TYPE == "ecdsa":
+    HOST_KEY = paramiko.ECDSAKey.generate()
+else:
+    sys.exit(f"unknown host key type {KEY_TYPE}, want rsa or ecdsa")
+
+
+class RefuseAll(paramiko.ServerInterface):
+    def get_allowed_auths(self, username):
+        return "password,publickey"
+
+    def check_auth_password(self, username, password):
+        return paramiko.AUTH_FAILED
+
+    def check_auth_publickey(self, username, key):
+        return paramiko.AUTH_FAILED
+
+
+def handle(conn, addr):
+    t = paramiko.Transport(conn)
+    try:
+        t.add_server_key(HOST_KEY)
+        if KEX:
+            t.get_security_options().kex = KEX
+        t.start_server(server=RefuseAll())
+        print(f"{addr[0]}:{addr[1]}: {t.host_key_type} {t.remote_cipher}")
+        # the client hangs up once it has its timing
+        while t.is_active():
+            t.join(1)
+    except (paramiko.SSHException, EOFError, ConnectionError) as e:
+        print(f"{addr[0]}:{addr[1]}: {e}")
+    finally:
+        t.close()
+
+
+srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+srv.bind(("0.0.0.0", PORT))
+srv.listen(4)
+print(f"SSH test server on port {PORT}, {KEY_TYPE} host key "
+      f"{HOST_KEY.fingerprint}")
+print(f"From Mac QEMU: sshbench 10.0.2.2:{PORT} fast")
+
+while True:
+    conn, addr = srv.accept()
+    threading.Thread(target=handle, args=(conn, addr), daemon=True).start()
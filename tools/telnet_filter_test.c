@@ -0,0 +1,422 @@
+/*
+ * Host-side differential test and benchmark for telnet_filter in
+ * iac.c: the memchr IAC/LF scan against the byte-at-a-time loop it
+ * replaced.
+ *
+ *   cc -O2 -I. -o telnet_filter_test tools/telnet_filter_test.c iac.c
+ *   ./telnet_filter_test [seed]
+ *
+ * The old loop is kept here as the reference, over the same iac_state
+ * and filter_state the real one uses. Random input with plenty of IAC,
+ * CR and LF is cut into random reads and run through both: the
+ * terminal output, the WILL/DO/SB callbacks and the parser state left
+ * at the end must all match. The old loop had no MCCP hand-off, so
+ * that is checked on its own: after IAC SB COMPRESS2 IAC SE the rest
+ * of the read must go to the stage telnet_handle_sb returns. Then each
+ * parser is timed over text fed in MSS sized reads.
+ */
+
+#include "iac.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TELOPT_COMPRESS2 86
+
+#define TS_DATA    0
+#define TS_IAC     1
+#define TS_WILL    2
+#define TS_WONT    3
+#define TS_DO      4
+#define TS_DONT    5
+#define TS_SB      6
+#define TS_SB_IAC  7
+
+/* the parts of struct session (app.h) the parsers use */
+struct session {
+	struct iac_state iac;
+	struct filter_state filter;
+};
+
+static struct session sessions[1];
+
+struct iac_state* iac_state(int session_idx)
+{
+	return &sessions[session_idx].iac;
+}
+
+struct filter_state* filter_state(int session_idx)
+{
+	return &sessions[session_idx].filter;
+}
+
+/* negotiation callbacks just log what they were given */
+static unsigned char events[65536];
+static size_t events_len;
+
+static void log_event(int kind, const unsigned char* buf, int len)
+{
+	if (events_len + 2 + len > sizeof(events)) return;
+	events[events_len++] = kind;
+	events[events_len++] = len;
+	memcpy(events + events_len, buf, len);
+	events_len += len;
+}
+
+void telnet_handle_will(int session_idx, unsigned char opt)
+{
+	log_event(TEL_WILL, &opt, 1);
+}
+
+void telnet_handle_do(int session_idx, unsigned char opt)
+{
+	log_event(TEL_DO, &opt, 1);
+}
+
+/* set by the MCCP check: where the rest of the read goes after
+   IAC SB COMPRESS2 IAC SE, NULL to keep parsing as the old loop did */
+static const struct filter_stage* mccp_stage;
+
+const struct filter_stage* telnet_handle_sb(int session_idx,
+                                            const unsigned char* buf, int len)
+{
+	log_event(TEL_SB, buf, len);
+	if (len >= 1 && buf[0] == TELOPT_COMPRESS2)
+		return mccp_stage;
+	return NULL;
+}
+
+/* telnet_filter before the memchr scan */
+static void telnet_filter_old(int session_idx, const char* buf, size_t len,
+                              const struct filter_stage* next)
+{
+	struct iac_state* t = &sessions[session_idx].iac;
+	struct filter_state* f = &sessions[session_idx].filter;
+	const unsigned char* in = (const unsigned char*)buf;
+	const unsigned char* end = in + len;
+	const unsigned char* run = in;   /* start of data not yet passed on */
+
+	while (in < end)
+	{
+		unsigned char c = *in;
+
+		if (t->state == TS_DATA)
+		{
+			if (c == TEL_IAC)
+			{
+				if (in > run)
+					filter_emit(session_idx, next, (const char*)run, in - run);
+				t->state = TS_IAC;
+				run = in + 1;
+			}
+			else if (c == '\n' && !f->crlf_prev_cr)
+			{
+				/* the LF itself starts the next run */
+				if (in > run)
+					filter_emit(session_idx, next, (const char*)run, in - run);
+				filter_emit(session_idx, next, "\r", 1);
+				run = in;
+			}
+			f->crlf_prev_cr = (c == '\r');
+			in++;
+			continue;
+		}
+
+		switch (t->state)
+		{
+			case TS_IAC:
+				switch (c)
+				{
+					case TEL_IAC:
+						filter_emit(session_idx, next, "\377", 1);
+						t->state = TS_DATA;
+						break;
+					case TEL_WILL:
+						t->state = TS_WILL;
+						break;
+					case TEL_WONT:
+						t->state = TS_WONT;
+						break;
+					case TEL_DO:
+						t->state = TS_DO;
+						break;
+					case TEL_DONT:
+						t->state = TS_DONT;
+						break;
+					case TEL_SB:
+						t->state = TS_SB;
+						t->sb_len = 0;
+						break;
+					default:
+						/* NOP, BRK, etc. — ignore */
+						t->state = TS_DATA;
+						break;
+				}
+				break;
+
+			case TS_WILL:
+				telnet_handle_will(session_idx, c);
+				t->state = TS_DATA;
+				break;
+
+			case TS_WONT:
+				/* acknowledge, nothing to do */
+				t->state = TS_DATA;
+				break;
+
+			case TS_DO:
+				telnet_handle_do(session_idx, c);
+				t->state = TS_DATA;
+				break;
+
+			case TS_DONT:
+				t->state = TS_DATA;
+				break;
+
+			case TS_SB:
+				if (c == TEL_IAC)
+					t->state = TS_SB_IAC;
+				else if (t->sb_len < (int)sizeof(t->sb_buf))
+					t->sb_buf[t->sb_len++] = c;
+				break;
+
+			case TS_SB_IAC:
+				if (c == TEL_SE)
+				{
+					telnet_handle_sb(session_idx, t->sb_buf, t->sb_len);
+					t->state = TS_DATA;
+				}
+				else
+				{
+					/* not SE, put byte into SB buffer */
+					if (t->sb_len < (int)sizeof(t->sb_buf))
+						t->sb_buf[t->sb_len++] = c;
+					t->state = TS_SB;
+				}
+				break;
+		}
+
+		f->crlf_prev_cr = 0;
+		in++;
+		run = in;
+	}
+
+	if (in > run)
+		filter_emit(session_idx, next, (const char*)run, in - run);
+}
+
+static char out[65536];
+static size_t out_len;
+
+static void collect(int session_idx, const char* buf, size_t len,
+                    const struct filter_stage* next)
+{
+	if (out_len + len > sizeof(out))
+	{
+		fprintf(stderr, "output overflow\n");
+		exit(2);
+	}
+	memcpy(out + out_len, buf, len);
+	out_len += len;
+}
+
+static const struct filter_stage collect_stage = { collect, NULL };
+
+/* the benchmark sink only counts, so the scan is what gets timed */
+static size_t counted;
+
+static void count(int session_idx, const char* buf, size_t len,
+                  const struct filter_stage* next)
+{
+	counted += len;
+}
+
+static const struct filter_stage count_stage = { count, NULL };
+
+/* the MCCP stage: takes what's left of the read, as is */
+static char rest[64];
+static size_t rest_len;
+
+static void collect_rest(int session_idx, const char* buf, size_t len,
+                         const struct filter_stage* next)
+{
+	if (rest_len + len > sizeof(rest))
+	{
+		fprintf(stderr, "output overflow\n");
+		exit(2);
+	}
+	memcpy(rest + rest_len, buf, len);
+	rest_len += len;
+}
+
+static const struct filter_stage rest_stage = { collect_rest, NULL };
+
+/* what one parser made of an input */
+struct result {
+	char out[sizeof(out)];
+	size_t out_len;
+	unsigned char events[sizeof(events)];
+	size_t events_len;
+	struct session s;
+};
+
+static void run_split(filter_fn fn, const unsigned char* in, size_t len,
+                      const size_t* cuts, int ncuts, struct result* r)
+{
+	size_t pos = 0;
+	int i;
+
+	memset(sessions, 0, sizeof(sessions));
+	out_len = 0;
+	events_len = 0;
+
+	for (i = 0; i <= ncuts; i++)
+	{
+		size_t stop = (i < ncuts) ? cuts[i] : len;
+
+		fn(0, (const char*)in + pos, stop - pos, &collect_stage);
+		pos = stop;
+	}
+
+	memcpy(r->out, out, out_len);
+	r->out_len = out_len;
+	memcpy(r->events, events, events_len);
+	r->events_len = events_len;
+	r->s = sessions[0];
+}
+
+static int same_result(const struct result* a, const struct result* b)
+{
+	return a->out_len == b->out_len && memcmp(a->out, b->out, a->out_len) == 0 &&
+	       a->events_len == b->events_len &&
+	       memcmp(a->events, b->events, a->events_len) == 0 &&
+	       a->s.iac.state == b->s.iac.state &&
+	       a->s.iac.sb_len == b->s.iac.sb_len &&
+	       memcmp(a->s.iac.sb_buf, b->s.iac.sb_buf, a->s.iac.sb_len) == 0 &&
+	       a->s.filter.crlf_prev_cr == b->s.filter.crlf_prev_cr;
+}
+
+/* mostly text, with the bytes the parsers care about thrown in */
+static unsigned char random_byte(void)
+{
+	static const unsigned char special[] = {
+		TEL_IAC, TEL_IAC, TEL_IAC, TEL_SE, TEL_SB, TEL_WILL, TEL_WONT,
+		TEL_DO, TEL_DONT, '\r', '\n', '\n', 24, 31, 0
+	};
+	int r = rand() % 8;
+
+	if (r < 4) return special[rand() % sizeof(special)];
+	if (r < 7) return 'a' + rand() % 26;
+	return rand() & 0xff;
+}
+
+static double mb_per_sec(filter_fn fn, const unsigned char* in, size_t len,
+                         size_t read_size, int rounds)
+{
+	clock_t start = clock();
+	double secs;
+	size_t pos;
+	int i;
+
+	for (i = 0; i < rounds; i++)
+	{
+		memset(sessions, 0, sizeof(sessions));
+		for (pos = 0; pos < len; pos += read_size)
+		{
+			size_t n = (len - pos < read_size) ? len - pos : read_size;
+			fn(0, (const char*)in + pos, n, &count_stage);
+		}
+	}
+
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	return secs > 0 ? (double)len * rounds / secs / 1e6 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	static struct result a, b;
+	static unsigned char in[4096];
+	static size_t cuts[4096];
+	unsigned seed = (argc > 1) ? (unsigned)atoi(argv[1]) : 1;
+	unsigned char* text;
+	size_t text_len = 4 * 1024 * 1024;
+	size_t i;
+	int failures = 0;
+	int ok = 1;
+	int n;
+
+	/* differential: random input, random reads */
+	srand(seed);
+	for (n = 0; n < 100000 && ok; n++)
+	{
+		size_t len = rand() % sizeof(in);
+		int ncuts = 0;
+
+		for (i = 0; i < len; i++)
+			in[i] = random_byte();
+		for (i = 1; i < len; i++)
+			if (rand() % 16 == 0)
+				cuts[ncuts++] = i;
+
+		run_split(telnet_filter_old, in, len, cuts, ncuts, &a);
+		run_split(telnet_filter, in, len, cuts, ncuts, &b);
+		ok = same_result(&a, &b);
+	}
+	if (!ok)
+		printf("seed %u case %d differs\n", seed, n - 1);
+	printf("%-36s %s\n", "old and new parsers agree", ok ? "ok" : "FAIL");
+	failures += !ok;
+
+	/* MCCP: after IAC SB COMPRESS2 IAC SE the parser lets go of the read */
+	{
+		static const char read[] = "ab\n\377\372\126\377\360\377\377x\n";
+		static const char after[] = "\377\377x\n";
+
+		memset(sessions, 0, sizeof(sessions));
+		out_len = 0;
+		rest_len = 0;
+		mccp_stage = &rest_stage;
+		telnet_filter(0, read, sizeof(read) - 1, &collect_stage);
+		mccp_stage = NULL;
+
+		ok = out_len == 4 && memcmp(out, "ab\r\n", 4) == 0 &&
+		     rest_len == sizeof(after) - 1 && memcmp(rest, after, rest_len) == 0 &&
+		     sessions[0].iac.state == TS_DATA;
+		printf("%-36s %s\n", "MCCP start hands on the rest", ok ? "ok" : "FAIL");
+		failures += !ok;
+	}
+
+	/* benchmark: 80 column lines, LF only, an IAC NOP every 64 KB */
+	text = malloc(text_len);
+	if (text == NULL) return 2;
+	for (i = 0; i < text_len; i++)
+	{
+		if (i % 65536 == 65534)
+			text[i] = TEL_IAC;
+		else if (i % 65536 == 65535)
+			text[i] = 241;
+		else
+			text[i] = (i % 81 == 80) ? '\n' : ' ' + i % 95;
+	}
+
+	{
+		static const size_t read_sizes[] = { 64, 536, 1460, 8192 };
+
+		for (i = 0; i < sizeof(read_sizes) / sizeof(read_sizes[0]); i++)
+		{
+			double old_rate = mb_per_sec(telnet_filter_old, text, text_len,
+			                             read_sizes[i], 10);
+			double new_rate = mb_per_sec(telnet_filter, text, text_len,
+			                             read_sizes[i], 10);
+
+			printf("%5lu byte reads: old %7.1f MB/s  new %7.1f MB/s  (x%.1f)\n",
+			       (unsigned long)read_sizes[i], old_rate, new_rate,
+			       old_rate > 0 ? new_rate / old_rate : 0);
+		}
+	}
+
+	free(text);
+	return failures != 0;
+}